@@ -1,18 +1,32 @@
 #include "apple_bce.h"
 #include <linux/module.h>
+#include <linux/interrupt.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include "audio/audio.h"
 
 static dev_t bce_chrdev;
 static struct class *bce_class;
 
+/*
+ * That the firmware signals a CQ's vector_or_cq N on MSI vector BCE_DMA_VECTOR_BASE + N is only confirmed for N = 0,
+ * a wrong mapping would lose every completion of the other vectors. Spreading the CQs is opt-in until then.
+ */
+static int bce_max_dma_vectors = 1;
+module_param_named(dma_vectors, bce_max_dma_vectors, int, 0444);
+MODULE_PARM_DESC(dma_vectors, "Maximum number of MSI vectors used for DMA completions (1-4, default 1)");
+
 struct apple_bce_device *global_bce;
 
 static int bce_create_command_queues(struct apple_bce_device *bce);
 static void bce_free_command_queues(struct apple_bce_device *bce);
 static irqreturn_t bce_handle_mb_irq(int irq, void *dev);
 static irqreturn_t bce_handle_dma_irq(int irq, void *dev);
+static int bce_request_dma_irqs(struct apple_bce_device *bce, int nvec);
+static void bce_free_dma_irqs(struct apple_bce_device *bce);
 static int bce_fw_version_handshake(struct apple_bce_device *bce);
 static int bce_register_command_queue(struct apple_bce_device *bce, struct bce_queue_memcfg *cfg, int is_sq);
+static void bce_debugfs_init(struct apple_bce_device *bce);
 
 static int apple_bce_probe(struct pci_dev *dev, const struct pci_device_id *id)
 {
@@ -62,10 +76,13 @@ static int apple_bce_probe(struct pci_dev *dev, const struct pci_device_id *id)
     bce_timestamp_init(&bce->timestamp, bce->reg_mem_mb);
 
     ida_init(&bce->queue_ida);
+    spin_lock_init(&bce->cq_list_lock);
+    if ((status = init_srcu_struct(&bce->queue_srcu)))
+        goto fail;
 
     if ((status = pci_request_irq(dev, 0, bce_handle_mb_irq, NULL, dev, "bce_mbox")))
-        goto fail;
-    if ((status = pci_request_irq(dev, 4, NULL, bce_handle_dma_irq, dev, "bce_dma")))
+        goto fail_srcu;
+    if ((status = bce_request_dma_irqs(bce, nvec)))
         goto fail_interrupt_0;
 
     if ((status = dma_set_mask_and_coherent(&dev->dev, DMA_BIT_MASK(37)))) {
@@ -73,6 +90,11 @@ static int apple_bce_probe(struct pci_dev *dev, const struct pci_device_id *id)
         goto fail_interrupt;
     }
 
+    if ((status = bce_dma_arenas_init(bce)))
+        goto fail_interrupt;
+    if ((status = bce_segl_pool_init(&bce->segl_pool, &dev->dev)))
+        goto fail_arenas;
+
     bce_timestamp_start(&bce->timestamp);
 
     if ((status = bce_fw_version_handshake(bce)))
@@ -86,16 +108,24 @@ static int apple_bce_probe(struct pci_dev *dev, const struct pci_device_id *id)
 
     global_bce = bce;
 
+    bce_queue_pool_init(bce);
+    bce_debugfs_init(bce);
+
     bce_vhci_create(bce, &bce->vhci);
 
     return 0;
 
 fail_ts:
     bce_timestamp_stop(&bce->timestamp);
+    bce_segl_pool_destroy(&bce->segl_pool);
+fail_arenas:
+    bce_dma_arenas_destroy(bce);
 fail_interrupt:
-    pci_free_irq(dev, 4, dev);
+    bce_free_dma_irqs(bce);
 fail_interrupt_0:
     pci_free_irq(dev, 0, dev);
+fail_srcu:
+    cleanup_srcu_struct(&bce->queue_srcu);
 fail:
     if (bce && bce->dev)
         device_destroy(bce_class, bce->devt);
@@ -126,9 +156,6 @@ static int bce_create_command_queues(struct apple_bce_device *bce)
         status = -ENOMEM;
         goto err;
     }
-    bce->queues[0] = (struct bce_queue *) bce->cmd_cq;
-    bce->queues[1] = (struct bce_queue *) bce->cmd_cmdq->sq;
-
     cfg = kzalloc(sizeof(struct bce_queue_memcfg), GFP_KERNEL);
     if (!cfg) {
         status = -ENOMEM;
@@ -142,6 +169,9 @@ static int bce_create_command_queues(struct apple_bce_device *bce)
         goto err;
     kfree(cfg);
 
+    bce_publish_queue(bce, (struct bce_queue *) bce->cmd_cq);
+    bce_publish_queue(bce, (struct bce_queue *) bce->cmd_cmdq->sq);
+
     return 0;
 
 err:
@@ -154,10 +184,11 @@ err:
 
 static void bce_free_command_queues(struct apple_bce_device *bce)
 {
+    bce_unpublish_queue(bce, (struct bce_queue *) bce->cmd_cmdq->sq);
+    bce_unpublish_queue(bce, (struct bce_queue *) bce->cmd_cq);
     bce_free_cq(bce, bce->cmd_cq);
     bce_free_cmdq(bce, bce->cmd_cmdq);
     bce->cmd_cq = NULL;
-    bce->queues[0] = NULL;
 }
 
 static irqreturn_t bce_handle_mb_irq(int irq, void *dev)
@@ -167,16 +198,77 @@ static irqreturn_t bce_handle_mb_irq(int irq, void *dev)
     return IRQ_HANDLED;
 }
 
+static irqreturn_t bce_handle_dma_irq_primary(int irq, void *dev)
+{
+    struct bce_dma_vector *vec = dev;
+    vec->irq_time = ktime_get();
+    return IRQ_WAKE_THREAD;
+}
+
 static irqreturn_t bce_handle_dma_irq(int irq, void *dev)
 {
-    int i;
-    struct apple_bce_device *bce = pci_get_drvdata(dev);
-    for (i = 0; i < BCE_MAX_QUEUE_COUNT; i++)
-        if (bce->queues[i] && bce->queues[i]->type == BCE_QUEUE_CQ)
-            bce_handle_cq_completions(bce, (struct bce_queue_cq *) bce->queues[i]);
+    int idx;
+    bool more;
+    struct bce_queue_cq *cq;
+    struct bce_dma_vector *vec = dev;
+    struct apple_bce_device *bce = vec->bce;
+    struct bce_sq_plug plug;
+    idx = srcu_read_lock(&bce->queue_srcu);
+    WRITE_ONCE(vec->drain_task, current);
+    ++vec->irq_count;
+    /* Resubmissions made by the completion callbacks ring each SQ's doorbell once per pass */
+    bce_start_plug(bce, &plug);
+    /* Round-robin over the CQs until all are drained, so one busy CQ can't starve the others */
+    do {
+        more = false;
+        list_for_each_entry_rcu(cq, &vec->cq_list, list) {
+            ++vec->cq_inspected;
+            more |= bce_handle_cq_completions(bce, cq);
+        }
+        if (more) {
+            bce_flush_plug(bce);
+            cond_resched();
+        }
+    } while (more);
+    bce_finish_plug(bce, &plug);
+    WRITE_ONCE(vec->drain_task, NULL);
+    srcu_read_unlock(&bce->queue_srcu, idx);
     return IRQ_HANDLED;
 }
 
+static int bce_request_dma_irqs(struct apple_bce_device *bce, int nvec)
+{
+    int i, status;
+    struct bce_dma_vector *vec;
+    bce->dma_vector_count = clamp(min(nvec - BCE_DMA_VECTOR_BASE, bce_max_dma_vectors), 1, BCE_MAX_DMA_VECTORS);
+    for (i = 0; i < bce->dma_vector_count; i++) {
+        vec = &bce->dma_vectors[i];
+        vec->bce = bce;
+        vec->index = i;
+        INIT_LIST_HEAD(&vec->cq_list);
+        vec->irq = pci_irq_vector(bce->pci, BCE_DMA_VECTOR_BASE + i);
+        if ((status = pci_request_irq(bce->pci, BCE_DMA_VECTOR_BASE + i, bce_handle_dma_irq_primary,
+                bce_handle_dma_irq, vec, "bce_dma%i", i))) {
+            bce->dma_vector_count = i;
+            bce_free_dma_irqs(bce);
+            return status;
+        }
+        /* Let the traffic classes complete on different CPUs */
+        irq_set_affinity_hint(vec->irq, cpumask_of(cpumask_local_spread(i, dev_to_node(&bce->pci->dev))));
+    }
+    pr_info("apple-bce: using %i DMA completion vectors\n", bce->dma_vector_count);
+    return 0;
+}
+
+static void bce_free_dma_irqs(struct apple_bce_device *bce)
+{
+    int i;
+    for (i = 0; i < bce->dma_vector_count; i++) {
+        irq_set_affinity_hint(bce->dma_vectors[i].irq, NULL);
+        pci_free_irq(bce->pci, BCE_DMA_VECTOR_BASE + i, &bce->dma_vectors[i]);
+    }
+}
+
 static int bce_fw_version_handshake(struct apple_bce_device *bce)
 {
     u64 result;
@@ -212,17 +304,200 @@ static int bce_register_command_queue(struct apple_bce_device *bce, struct bce_q
     return 0;
 }
 
+static int bce_dma_irq_stats_show(struct seq_file *s, void *unused)
+{
+    int i;
+    u64 irqs, inspected;
+    struct apple_bce_device *bce = s->private;
+    struct bce_dma_vector *vec;
+    /* The handler used to walk every queue slot on each interrupt */
+    seq_printf(s, "slots_scanned_per_irq_before: %u\n", BCE_MAX_QUEUE_COUNT);
+    for (i = 0; i < bce->dma_vector_count; i++) {
+        vec = &bce->dma_vectors[i];
+        irqs = vec->irq_count;
+        inspected = vec->cq_inspected;
+        seq_printf(s, "vector %i (irq %i): interrupts %llu cqs_inspected %llu cqs_inspected_per_irq %llu\n",
+                i, vec->irq, irqs, inspected, irqs ? inspected / irqs : 0);
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bce_dma_irq_stats);
+
+static void bce_cq_latency_show(struct seq_file *s, const char *mode, struct bce_cq_latency *lat)
+{
+    seq_printf(s, "    %s_latency: samples %llu avg_ns %llu max_ns %llu\n", mode, lat->count,
+            lat->count ? lat->total_ns / lat->count : 0, lat->max_ns);
+}
+
+static int bce_cq_stats_show(struct seq_file *s, void *unused)
+{
+    int i, idx;
+    struct apple_bce_device *bce = s->private;
+    struct bce_queue_cq *cq;
+    idx = srcu_read_lock(&bce->queue_srcu);
+    for (i = 0; i < bce->dma_vector_count; i++) {
+        list_for_each_entry_rcu(cq, &bce->dma_vectors[i].cq_list, list) {
+            seq_printf(s, "cq %i: vector %i el_count %u budget %u doorbell_batch %u passes %llu budget_exhausted %llu\n",
+                    cq->qid, cq->vector, cq->el_count, cq->budget, cq->doorbell_batch,
+                    cq->stat_passes, cq->stat_budget_exhausted);
+            seq_printf(s, "    poll: users %i interval_us %u armed %i\n", atomic_read(&cq->poll_users),
+                    cq->poll_interval_us, atomic_read(&cq->poll_armed));
+            bce_cq_latency_show(s, "irq", &cq->latency_irq);
+            bce_cq_latency_show(s, "poll", &cq->latency_poll);
+        }
+    }
+    srcu_read_unlock(&bce->queue_srcu, idx);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bce_cq_stats);
+
+static int bce_sq_stats_show(struct seq_file *s, void *unused)
+{
+    int i, idx;
+    struct apple_bce_device *bce = s->private;
+    struct bce_queue *q;
+    struct bce_queue_sq *sq;
+    idx = srcu_read_lock(&bce->queue_srcu);
+    for (i = 0; i < BCE_MAX_QUEUE_COUNT; i++) {
+        q = srcu_dereference(bce->queues[i], &bce->queue_srcu);
+        if (!q || q->type != BCE_QUEUE_SQ)
+            continue;
+        sq = (struct bce_queue_sq *) q;
+        seq_printf(s, "sq %i: el_count %u submissions %llu doorbells %llu\n", sq->qid, sq->el_count,
+                sq->stat_submissions, sq->stat_doorbells);
+        seq_printf(s, "    credit waits %llu timeouts %llu avg_ns %llu max_ns %llu\n", sq->stat_waits,
+                sq->stat_wait_timeouts, sq->stat_waits ? sq->stat_wait_total_ns / sq->stat_waits : 0,
+                sq->stat_wait_max_ns);
+    }
+    srcu_read_unlock(&bce->queue_srcu, idx);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bce_sq_stats);
+
+static void bce_queue_pool_stat_show(struct seq_file *s, const char *kind, struct bce_queue_pool_stat *stat)
+{
+    u64 hits = (u64) atomic64_read(&stat->hits);
+    u64 misses = (u64) atomic64_read(&stat->misses);
+    u64 n = hits + misses;
+    seq_printf(s, "%s: hits %llu misses %llu avg_create_ns %llu\n", kind, hits, misses,
+            n ? (u64) atomic64_read(&stat->total_ns) / n : 0);
+}
+
+static int bce_queue_pool_show(struct seq_file *s, void *unused)
+{
+    int i;
+    struct apple_bce_device *bce = s->private;
+    struct bce_queue_pool *pool = &bce->queue_pool;
+    mutex_lock(&pool->lock);
+    seq_printf(s, "target %u\n", pool->target);
+    for (i = 0; i < bce->dma_vector_count; i++)
+        seq_printf(s, "vector %i: ready cqs %u\n", i, pool->cq_count[i]);
+    seq_printf(s, "ready sqs %u\n", pool->sq_count);
+    bce_queue_pool_stat_show(s, "cq", &pool->cq_stat);
+    bce_queue_pool_stat_show(s, "sq", &pool->sq_stat);
+    mutex_unlock(&pool->lock);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bce_queue_pool);
+
+static int bce_dma_arena_show(struct seq_file *s, void *unused)
+{
+    static const char *const names[BCE_DMA_SUBSYSTEM_COUNT] = {"queues", "vhci", "audio"};
+    int i;
+    struct apple_bce_device *bce = s->private;
+    struct bce_dma_arena *a;
+    for (i = 0; i < BCE_DMA_SUBSYSTEM_COUNT; i++) {
+        a = &bce->dma_arenas[i];
+        mutex_lock(&a->lock);
+        seq_printf(s, "%s: dma_bytes %llu used_bytes %llu wasted_bytes %llu mappings %llu (chunks %llu direct %llu)\n",
+                names[i], a->stat_chunk_bytes + a->stat_direct_bytes, a->stat_used_bytes + a->stat_direct_used_bytes,
+                a->stat_chunk_bytes - a->stat_used_bytes + a->stat_direct_bytes - a->stat_direct_used_bytes,
+                a->stat_chunk_count + a->stat_direct_count, a->stat_chunk_count, a->stat_direct_count);
+        mutex_unlock(&a->lock);
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bce_dma_arena);
+
+static int bce_segl_pool_show(struct seq_file *s, void *unused)
+{
+    unsigned long flags;
+    struct apple_bce_device *bce = s->private;
+    struct bce_segl_pool *pool = &bce->segl_pool;
+    spin_lock_irqsave(&pool->lock, flags);
+    seq_printf(s, "free %u hits %llu misses %llu\n", pool->free_count, pool->stat_hits, pool->stat_misses);
+    spin_unlock_irqrestore(&pool->lock, flags);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bce_segl_pool);
+
+static int bce_vhci_iso_show(struct seq_file *s, void *unused)
+{
+    struct apple_bce_device *bce = s->private;
+    struct bce_vhci_iso_stats *st = &bce->vhci.iso_stats;
+    seq_printf(s, "urbs %lld packets %lld missed %lld bytes %lld\n", (long long) atomic64_read(&st->urbs),
+            (long long) atomic64_read(&st->packets), (long long) atomic64_read(&st->missed),
+            (long long) atomic64_read(&st->bytes));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bce_vhci_iso);
+
+static int bce_vhci_queues_show(struct seq_file *s, void *unused)
+{
+    struct apple_bce_device *bce = s->private;
+    bce_vhci_report_queues(&bce->vhci, s);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bce_vhci_queues);
+
+#ifdef BCE_RING_BENCH
+/* Runs the ring microbenchmark on every read; only in builds made with BCE_RING_BENCH=1 */
+static int bce_ring_bench_show(struct seq_file *s, void *unused)
+{
+    static const u32 batches[] = {1, 16, 64};
+    int i;
+    for (i = 0; i < ARRAY_SIZE(batches); i++) {
+        seq_printf(s, "reserve/submit/complete batch %u: %llu ns/element\n", batches[i],
+                bce_sq_ring_bench(1 << 20, batches[i]));
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bce_ring_bench);
+#endif
+
+static void bce_debugfs_init(struct apple_bce_device *bce)
+{
+    bce->debugfs = debugfs_create_dir("apple-bce", NULL);
+    debugfs_create_file("dma_irq_stats", 0444, bce->debugfs, bce, &bce_dma_irq_stats_fops);
+    debugfs_create_file("cq_stats", 0444, bce->debugfs, bce, &bce_cq_stats_fops);
+    debugfs_create_file("sq_stats", 0444, bce->debugfs, bce, &bce_sq_stats_fops);
+#ifdef BCE_RING_BENCH
+    debugfs_create_file("ring_bench", 0400, bce->debugfs, bce, &bce_ring_bench_fops);
+#endif
+    debugfs_create_file("queue_pool", 0444, bce->debugfs, bce, &bce_queue_pool_fops);
+    debugfs_create_file("dma_arena", 0444, bce->debugfs, bce, &bce_dma_arena_fops);
+    debugfs_create_file("segl_pool", 0444, bce->debugfs, bce, &bce_segl_pool_fops);
+    debugfs_create_file("vhci_iso", 0444, bce->debugfs, bce, &bce_vhci_iso_fops);
+    debugfs_create_file("vhci_queues", 0444, bce->debugfs, bce, &bce_vhci_queues_fops);
+}
+
 static void apple_bce_remove(struct pci_dev *dev)
 {
     struct apple_bce_device *bce = pci_get_drvdata(dev);
     bce->is_being_removed = true;
 
+    debugfs_remove_recursive(bce->debugfs);
+
     bce_vhci_destroy(&bce->vhci);
+    bce_queue_pool_destroy(bce);
 
     bce_timestamp_stop(&bce->timestamp);
     pci_free_irq(dev, 0, dev);
-    pci_free_irq(dev, 4, dev);
+    bce_free_dma_irqs(bce);
     bce_free_command_queues(bce);
+    bce_segl_pool_destroy(&bce->segl_pool);
+    bce_dma_arenas_destroy(bce);
+    cleanup_srcu_struct(&bce->queue_srcu);
     pci_iounmap(dev, bce->reg_mem_mb);
     pci_iounmap(dev, bce->reg_mem_dma);
     device_destroy(bce_class, bce->devt);
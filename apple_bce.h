@@ -2,8 +2,12 @@
 
 #include <linux/pci.h>
 #include <linux/spinlock.h>
+#include <linux/srcu.h>
+#include <linux/workqueue.h>
+#include "dma_arena.h"
 #include "mailbox.h"
 #include "queue.h"
+#include "queue_dma.h"
 #include "vhci/vhci.h"
 
 #define BC_PROTOCOL_VERSION 0x20001
@@ -12,6 +16,49 @@
 #define BCE_QUEUE_USER_MIN 2
 #define BCE_QUEUE_USER_MAX (BCE_MAX_QUEUE_COUNT - 1)
 
+/* MSI vectors from BCE_DMA_VECTOR_BASE upwards signal completions; a CQ's vector_or_cq is relative to it */
+#define BCE_DMA_VECTOR_BASE 4
+#define BCE_MAX_DMA_VECTORS 4
+#define BCE_MAX_PLUGS 8
+
+struct bce_dma_vector {
+    struct apple_bce_device *bce;
+    int index;
+    int irq;
+    ktime_t irq_time; /* when the hard interrupt last fired, for latency accounting */
+    struct task_struct *drain_task; /* the IRQ thread while it is inside a completion pass */
+    struct list_head cq_list; /* registered CQs routed to this vector */
+    struct bce_queue_sq *int_sq_list[BCE_MAX_QUEUE_COUNT];
+    u64 irq_count;
+    u64 cq_inspected;
+};
+
+/*
+ * Warm pool of queues for new endpoints: CQs already registered with the firmware for each DMA vector, and SQs that
+ * are allocated but not registered yet, since the firmware wants their name at registration time.
+ */
+/*
+ * Pooled queues have the largest size they serve. A CQ that is registered already can't shrink, so a smaller request
+ * gets the whole ring; an SQ is only registered when it is taken, with just the size that was asked for.
+ */
+#define BCE_POOL_CQ_MAX_EL_COUNT 0x400
+#define BCE_POOL_SQ_MAX_EL_COUNT 0x100
+struct bce_queue_pool_stat {
+    atomic64_t hits;
+    atomic64_t misses;
+    atomic64_t total_ns; /* time spent in bce_create_cq/bce_create_sq */
+};
+struct bce_queue_pool {
+    struct mutex lock;
+    u32 target;
+    struct list_head cqs[BCE_MAX_DMA_VECTORS];
+    u32 cq_count[BCE_MAX_DMA_VECTORS];
+    struct list_head sqs;
+    u32 sq_count;
+    struct work_struct refill_work;
+    struct bce_queue_pool_stat cq_stat, sq_stat;
+};
+
 struct apple_bce_device {
     struct pci_dev *pci;
     dev_t devt;
@@ -21,12 +68,26 @@ struct apple_bce_device {
     struct bce_mailbox mbox;
     struct bce_timestamp timestamp;
     struct bce_queue *queues[BCE_MAX_QUEUE_COUNT];
+    struct spinlock cq_list_lock;
+    /*
+     * Protects queues[] and cq_list readers. A completion pass holds the read side across the SQ callbacks, so they
+     * may sleep but must never wait for a queue teardown (bce_sync_queues).
+     */
+    struct srcu_struct queue_srcu;
     struct ida queue_ida;
     struct bce_queue_cq *cmd_cq;
     struct bce_queue_cmdq *cmd_cmdq;
-    struct bce_queue_sq *int_sq_list[BCE_MAX_QUEUE_COUNT];
+    struct bce_dma_vector dma_vectors[BCE_MAX_DMA_VECTORS];
+    int dma_vector_count;
+    struct bce_queue_pool queue_pool;
+    struct bce_dma_arena dma_arenas[BCE_DMA_SUBSYSTEM_COUNT];
+    struct bce_segl_pool segl_pool;
+    struct task_struct *plug_owners[BCE_MAX_PLUGS];
+    struct bce_sq_plug *plugs[BCE_MAX_PLUGS];
     bool is_being_removed;
 
+    struct dentry *debugfs;
+
     struct bce_vhci vhci;
 };
 
@@ -125,6 +125,8 @@ static int aaudio_pcm_open(struct snd_pcm_substream *substream)
     stream->needs_start_io_compl = true;
     spin_unlock(&sdev->out_streams[0].start_io_sl);
 
+    /* Poll the audio CQ while the stream is open, so that the period timestamps arrive on time */
+    bce_cq_poll_start(sdev->a->bcem.cq);
     aaudio_cmd_start_io(sdev->a, sdev->dev_id);
     wait_for_completion_timeout(&stream->start_io_compl, 500);
 
@@ -141,6 +143,7 @@ static int aaudio_pcm_close(struct snd_pcm_substream *substream)
     pr_info("aaudio_pcm_close\n");
 
     aaudio_cmd_stop_io(sdev->a, sdev->dev_id);
+    bce_cq_poll_stop(sdev->a->bcem.cq);
     return 0;
 }
 
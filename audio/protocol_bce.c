@@ -1,4 +1,5 @@
 #include "protocol_bce.h"
+#include <linux/log2.h>
 
 #include "audio.h"
 
@@ -12,7 +13,7 @@ int aaudio_bce_init(struct aaudio_device *dev)
 {
     int status;
     struct aaudio_bce *bce = &dev->bcem;
-    bce->cq = bce_create_cq(dev->bce, 0x80);
+    bce->cq = bce_create_cq(dev->bce, 0x80, BCE_CQ_VECTOR_AUDIO);
     spin_lock_init(&bce->spinlock);
     if (!bce->cq)
         return -EINVAL;
@@ -34,12 +35,22 @@ int aaudio_bce_queue_init(struct aaudio_device *dev, struct aaudio_bce_queue *q,
     q->cq = dev->bcem.cq;
     q->el_size = AAUDIO_BCE_QUEUE_ELEMENT_SIZE;
     q->el_count = AAUDIO_BCE_QUEUE_ELEMENT_COUNT;
-    /* NOTE: The Apple impl uses 0x80 as the queue size, however we use 21 (in fact 20) to simplify the impl */
-    q->sq = bce_create_sq(dev->bce, q->cq, name, (u32) (q->el_count + 1), direction, cfn, dev);
+    /* NOTE: The Apple impl uses 0x80 as the queue size, however we use 20 to simplify the impl */
+    q->sq = bce_create_sq(dev->bce, q->cq, name, (u32) roundup_pow_of_two(q->el_count + 1), direction, cfn, dev);
     if (!q->sq)
         return -EINVAL;
+    /* Commands are sent without a lock, each one into the data slot of the SQ slot it claims */
+    if (direction == DMA_TO_DEVICE && bce_sq_enable_multi_producer(q->sq)) {
+        bce_destroy_sq(dev->bce, q->sq);
+        return -ENOMEM;
+    }
 
-    q->data = dma_alloc_coherent(&dev->bce->pci->dev, q->el_size * q->el_count, &q->dma_addr, GFP_KERNEL);
+    /*
+     * Only the rings are rounded up to a power of two. The receive buffers are used in turn, but a command goes into
+     * the data slot of the SQ slot it claims, so the send queue needs one for every SQ slot.
+     */
+    q->data = bce_dma_alloc(dev->bce, BCE_DMA_AUDIO,
+            q->el_size * (direction == DMA_TO_DEVICE ? q->sq->el_count : q->el_count), &q->dma_addr);
     if (!q->data) {
         bce_destroy_sq(dev->bce, q->sq);
         return -EINVAL;
@@ -50,23 +61,20 @@ int aaudio_bce_queue_init(struct aaudio_device *dev, struct aaudio_bce_queue *q,
 static void aaudio_send_create_tag(struct aaudio_bce *b, int *tagn, char tag[4])
 {
     char tag_zero[5];
-    b->tag_num = (b->tag_num + 1) % AAUDIO_BCE_QUEUE_TAG_COUNT;
-    *tagn = b->tag_num;
-    snprintf(tag_zero, 5, "S%03d", b->tag_num);
+    *tagn = (int) ((u32) atomic_inc_return(&b->tag_num) % AAUDIO_BCE_QUEUE_TAG_COUNT);
+    snprintf(tag_zero, 5, "S%03d", *tagn);
     *((u32 *) tag) = *((u32 *) tag_zero);
 }
 
 int __aaudio_send_prepare(struct aaudio_bce *b, struct aaudio_send_ctx *ctx, char *tag)
 {
     int status;
-    size_t index;
     void *dptr;
     struct aaudio_msg_header *header;
     if ((status = bce_reserve_submission(b->qout.sq, &ctx->timeout)))
         return status;
-    spin_lock_irqsave(&b->spinlock, ctx->irq_flags);
-    index = b->qout.data_tail;
-    dptr = (u8 *) b->qout.data + index * b->qout.el_size;
+    ctx->ticket = bce_mp_claim_submission(b->qout.sq);
+    dptr = (u8 *) b->qout.data + bce_mp_slot(b->qout.sq, ctx->ticket) * b->qout.el_size;
     ctx->msg.data = dptr;
     header = dptr;
     if (tag)
@@ -78,15 +86,13 @@ int __aaudio_send_prepare(struct aaudio_bce *b, struct aaudio_send_ctx *ctx, cha
 
 void __aaudio_send(struct aaudio_bce *b, struct aaudio_send_ctx *ctx)
 {
-    struct bce_qe_submission *s = bce_next_submission(b->qout.sq);
+    struct bce_qe_submission *s = bce_sq_submission(b->qout.sq, bce_mp_slot(b->qout.sq, ctx->ticket));
 #ifdef DEBUG
     pr_debug("aaudio: Sending command data\n");
     print_hex_dump(KERN_DEBUG, "aaudio:OUT ", DUMP_PREFIX_NONE, 32, 1, ctx->msg.data, ctx->msg.size, true);
 #endif
     bce_set_submission_single(s, b->qout.dma_addr + (dma_addr_t) (ctx->msg.data - b->qout.data), ctx->msg.size);
-    bce_submit_to_device(b->qout.sq);
-    b->qout.data_tail = (b->qout.data_tail + 1) % b->qout.el_count;
-    spin_unlock_irqrestore(&b->spinlock, ctx->irq_flags);
+    bce_mp_publish_submission(b->qout.sq, ctx->ticket);
 }
 
 int __aaudio_send_cmd_sync(struct aaudio_bce *b, struct aaudio_send_ctx *ctx, struct aaudio_msg *reply)
@@ -95,8 +101,11 @@ int __aaudio_send_cmd_sync(struct aaudio_bce *b, struct aaudio_send_ctx *ctx, st
     DECLARE_COMPLETION_ONSTACK(cmpl);
     ent.msg = reply;
     ent.cmpl = &cmpl;
+    spin_lock_irqsave(&b->spinlock, ctx->irq_flags);
     b->pending_entries[ctx->tag_n] = &ent;
-    __aaudio_send(b, ctx); /* unlocks the spinlock */
+    spin_unlock_irqrestore(&b->spinlock, ctx->irq_flags);
+    __aaudio_send(b, ctx);
+    bce_flush_plug(b->qout.sq->dev);
     ctx->timeout = wait_for_completion_timeout(&cmpl, ctx->timeout);
     if (ctx->timeout == 0) {
         /* Remove the pending queue entry; this will be normally handled by the completion route but
@@ -199,12 +208,12 @@ static void aaudio_bce_in_queue_handle_msg(struct aaudio_device *a, struct aaudi
 
 void aaudio_bce_in_queue_submit_pending(struct aaudio_bce_queue *q, size_t count)
 {
+    size_t reserved;
     struct bce_qe_submission *s;
-    while (count--) {
-        if (bce_reserve_submission(q->sq, NULL)) {
-            pr_err("aaudio: Failed to reserve an event queue submission\n");
-            break;
-        }
+    reserved = bce_try_reserve_submissions(q->sq, (u32) count);
+    if (reserved < count)
+        pr_err("aaudio: Failed to reserve an event queue submission\n");
+    while (reserved--) {
         s = bce_next_submission(q->sq);
         bce_set_submission_single(s, q->dma_addr + (dma_addr_t) (q->data_tail * q->el_size), q->el_size);
         q->data_tail = (q->data_tail + 1) % q->el_count;
@@ -27,14 +27,15 @@ struct aaudio_bce {
     struct bce_queue_cq *cq;
     struct aaudio_bce_queue qin;
     struct aaudio_bce_queue qout;
-    int tag_num;
+    atomic_t tag_num;
     struct aaudio_bce_queue_entry *pending_entries[AAUDIO_BCE_QUEUE_TAG_COUNT];
-    struct spinlock spinlock;
+    struct spinlock spinlock; /* protects pending_entries; sending doesn't need it, qout is multi-producer */
 };
 
 struct aaudio_send_ctx {
     int status;
     int tag_n;
+    u32 ticket;
     unsigned long irq_flags;
     struct aaudio_msg msg;
     unsigned long timeout;
@@ -0,0 +1,144 @@
+#include "dma_arena.h"
+#include "apple_bce.h"
+
+int bce_dma_arenas_init(struct apple_bce_device *dev)
+{
+    int i;
+    struct bce_dma_arena *a;
+    for (i = 0; i < BCE_DMA_SUBSYSTEM_COUNT; i++) {
+        a = &dev->dma_arenas[i];
+        mutex_init(&a->lock);
+        INIT_LIST_HEAD(&a->chunks);
+    }
+    return 0;
+}
+
+static void bce_dma_arena_chunk_free(struct apple_bce_device *dev, struct bce_dma_arena *a,
+        struct bce_dma_arena_chunk *c)
+{
+    list_del(&c->list);
+    gen_pool_destroy(c->pool);
+    dma_free_coherent(&dev->pci->dev, BCE_DMA_ARENA_CHUNK_SIZE, c->vaddr, c->dma_addr);
+    kfree(c);
+    a->stat_chunk_bytes -= BCE_DMA_ARENA_CHUNK_SIZE;
+    --a->stat_chunk_count;
+}
+
+void bce_dma_arenas_destroy(struct apple_bce_device *dev)
+{
+    int i;
+    struct bce_dma_arena *a;
+    struct bce_dma_arena_chunk *c, *ct;
+    for (i = 0; i < BCE_DMA_SUBSYSTEM_COUNT; i++) {
+        a = &dev->dma_arenas[i];
+        list_for_each_entry_safe(c, ct, &a->chunks, list) {
+            /* gen_pool_destroy would BUG on the live allocations, leak the chunk instead */
+            if (c->used)
+                pr_err("bce: DMA arena %i destroyed with %zu bytes still in use\n", i, c->used);
+            else
+                bce_dma_arena_chunk_free(dev, a, c);
+        }
+    }
+}
+
+static struct bce_dma_arena_chunk *bce_dma_arena_grow(struct apple_bce_device *dev, struct bce_dma_arena *a)
+{
+    struct bce_dma_arena_chunk *c;
+    c = kzalloc(sizeof(struct bce_dma_arena_chunk), GFP_KERNEL);
+    if (!c)
+        return NULL;
+    c->pool = gen_pool_create(PAGE_SHIFT, dev_to_node(&dev->pci->dev));
+    if (!c->pool)
+        goto fail;
+    c->vaddr = dma_alloc_coherent(&dev->pci->dev, BCE_DMA_ARENA_CHUNK_SIZE, &c->dma_addr, GFP_KERNEL);
+    if (!c->vaddr)
+        goto fail_pool;
+    if (gen_pool_add_virt(c->pool, (unsigned long) c->vaddr, (phys_addr_t) c->dma_addr, BCE_DMA_ARENA_CHUNK_SIZE,
+            dev_to_node(&dev->pci->dev)))
+        goto fail_chunk;
+    list_add_tail(&c->list, &a->chunks);
+    a->stat_chunk_bytes += BCE_DMA_ARENA_CHUNK_SIZE;
+    ++a->stat_chunk_count;
+    return c;
+
+fail_chunk:
+    dma_free_coherent(&dev->pci->dev, BCE_DMA_ARENA_CHUNK_SIZE, c->vaddr, c->dma_addr);
+fail_pool:
+    gen_pool_destroy(c->pool);
+fail:
+    kfree(c);
+    return NULL;
+}
+
+/* Zeroed and page aligned like dma_alloc_coherent */
+void *bce_dma_alloc(struct apple_bce_device *dev, enum bce_dma_subsystem ss, size_t size, dma_addr_t *dma_addr)
+{
+    struct bce_dma_arena *a = &dev->dma_arenas[ss];
+    struct bce_dma_arena_chunk *c;
+    unsigned long vaddr = 0;
+    void *ret;
+
+    if (size > BCE_DMA_ARENA_MAX_SUBALLOC) {
+        ret = dma_alloc_coherent(&dev->pci->dev, size, dma_addr, GFP_KERNEL);
+        if (ret) {
+            mutex_lock(&a->lock);
+            a->stat_direct_bytes += PAGE_ALIGN(size);
+            a->stat_direct_used_bytes += size;
+            ++a->stat_direct_count;
+            mutex_unlock(&a->lock);
+        }
+        return ret;
+    }
+
+    mutex_lock(&a->lock);
+    list_for_each_entry(c, &a->chunks, list) {
+        if ((vaddr = gen_pool_alloc(c->pool, size)))
+            break;
+    }
+    if (!vaddr && (c = bce_dma_arena_grow(dev, a)))
+        vaddr = gen_pool_alloc(c->pool, size);
+    if (vaddr) {
+        c->used += size;
+        a->stat_used_bytes += size;
+        *dma_addr = (dma_addr_t) gen_pool_virt_to_phys(c->pool, vaddr);
+    }
+    mutex_unlock(&a->lock);
+    if (!vaddr)
+        return NULL;
+    memset((void *) vaddr, 0, size);
+    return (void *) vaddr;
+}
+
+void bce_dma_free(struct apple_bce_device *dev, enum bce_dma_subsystem ss, size_t size, void *vaddr,
+        dma_addr_t dma_addr)
+{
+    struct bce_dma_arena *a = &dev->dma_arenas[ss];
+    struct bce_dma_arena_chunk *c;
+    if (!vaddr)
+        return;
+    if (size > BCE_DMA_ARENA_MAX_SUBALLOC) {
+        dma_free_coherent(&dev->pci->dev, size, vaddr, dma_addr);
+        mutex_lock(&a->lock);
+        a->stat_direct_bytes -= PAGE_ALIGN(size);
+        a->stat_direct_used_bytes -= size;
+        --a->stat_direct_count;
+        mutex_unlock(&a->lock);
+        return;
+    }
+    mutex_lock(&a->lock);
+    list_for_each_entry(c, &a->chunks, list) {
+        if (vaddr >= c->vaddr && vaddr < c->vaddr + BCE_DMA_ARENA_CHUNK_SIZE)
+            break;
+    }
+    if (WARN_ON(&c->list == &a->chunks)) {
+        mutex_unlock(&a->lock);
+        return;
+    }
+    gen_pool_free(c->pool, (unsigned long) vaddr, size);
+    c->used -= size;
+    a->stat_used_bytes -= size;
+    /* Give empty chunks back, but keep the last one around for the next ring */
+    if (!c->used && !list_is_singular(&a->chunks))
+        bce_dma_arena_chunk_free(dev, a, c);
+    mutex_unlock(&a->lock);
+}
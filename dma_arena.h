@@ -0,0 +1,53 @@
+#ifndef BCE_DMA_ARENA_H
+#define BCE_DMA_ARENA_H
+
+#include <linux/genalloc.h>
+#include <linux/mutex.h>
+#include <linux/pci.h>
+
+struct apple_bce_device;
+
+/*
+ * Small rings are carved out of chunks of this size; anything bigger than a quarter of it gets its own mapping, which
+ * includes the aaudio data buffers. Sub-allocations are whole pages, as the rings were when each had its own mapping.
+ */
+#define BCE_DMA_ARENA_CHUNK_SIZE 0x10000
+#define BCE_DMA_ARENA_MAX_SUBALLOC (BCE_DMA_ARENA_CHUNK_SIZE / 4)
+
+enum bce_dma_subsystem {
+    BCE_DMA_QUEUES,
+    BCE_DMA_VHCI,
+    BCE_DMA_AUDIO,
+    BCE_DMA_SUBSYSTEM_COUNT
+};
+
+/* Each chunk has its own gen_pool, so that a chunk can be unmapped again once it is empty */
+struct bce_dma_arena_chunk {
+    struct list_head list;
+    struct gen_pool *pool;
+    void *vaddr;
+    dma_addr_t dma_addr;
+    size_t used;
+};
+
+/* One arena per subsystem, so that the accounting can be reported per subsystem */
+struct bce_dma_arena {
+    struct mutex lock;
+    struct list_head chunks;
+
+    u64 stat_chunk_bytes;    /* total of the chunk mappings */
+    u64 stat_used_bytes;     /* requested by the live sub-allocations */
+    u64 stat_direct_bytes;   /* mapped for allocations too big to share a chunk */
+    u64 stat_direct_used_bytes;
+    u64 stat_direct_count;
+    u64 stat_chunk_count;
+};
+
+int bce_dma_arenas_init(struct apple_bce_device *dev);
+void bce_dma_arenas_destroy(struct apple_bce_device *dev);
+
+void *bce_dma_alloc(struct apple_bce_device *dev, enum bce_dma_subsystem ss, size_t size, dma_addr_t *dma_addr);
+void bce_dma_free(struct apple_bce_device *dev, enum bce_dma_subsystem ss, size_t size, void *vaddr,
+        dma_addr_t dma_addr);
+
+#endif //BCE_DMA_ARENA_H
@@ -1,17 +1,90 @@
 #include "queue.h"
 #include "apple_bce.h"
+#include <linux/interrupt.h>
+#include <linux/log2.h>
+#include <linux/moduleparam.h>
+#include <linux/rculist.h>
 
 #define REG_DOORBELL_BASE 0x44000
 
+static uint bce_cq_budget = 64;
+module_param_named(cq_budget, bce_cq_budget, uint, 0644);
+MODULE_PARM_DESC(cq_budget, "Default number of completions handled per CQ before yielding to other CQs");
+static uint bce_cq_doorbell_batch = 16;
+module_param_named(cq_doorbell_batch, bce_cq_doorbell_batch, uint, 0644);
+MODULE_PARM_DESC(cq_doorbell_batch, "Default number of completions consumed between CQ doorbell updates");
+static uint bce_cq_poll_interval_us = 100;
+module_param_named(cq_poll_interval_us, bce_cq_poll_interval_us, uint, 0644);
+MODULE_PARM_DESC(cq_poll_interval_us, "Default interval of the busy-poll timer for CQs in poll mode");
+
+/* A polled CQ goes back to being interrupt driven after this long without completions */
+#define BCE_CQ_POLL_IDLE_US 10000
+
+static enum hrtimer_restart bce_cq_poll_timer(struct hrtimer *timer);
+static void bce_sq_init_credits(struct bce_queue_sq *sq);
+
+/* Makes the queue visible to the DMA interrupt handler (the CQ list and the qid lookup table) */
+void bce_publish_queue(struct apple_bce_device *dev, struct bce_queue *q)
+{
+    spin_lock(&dev->cq_list_lock);
+    rcu_assign_pointer(dev->queues[q->qid], q);
+    if (q->type == BCE_QUEUE_CQ)
+        list_add_tail_rcu(&((struct bce_queue_cq *) q)->list,
+                &dev->dma_vectors[((struct bce_queue_cq *) q)->vector].cq_list);
+    spin_unlock(&dev->cq_list_lock);
+}
+
+/* Hides the queue from the interrupt handler and waits until no handler can still be looking at it */
+void bce_unpublish_queue(struct apple_bce_device *dev, struct bce_queue *q)
+{
+    spin_lock(&dev->cq_list_lock);
+    if (dev->queues[q->qid] == q)
+        RCU_INIT_POINTER(dev->queues[q->qid], NULL);
+    if (q->type == BCE_QUEUE_CQ)
+        list_del_rcu(&((struct bce_queue_cq *) q)->list);
+    spin_unlock(&dev->cq_list_lock);
+    bce_sync_queues(dev);
+}
+
+static bool bce_in_completion_pass(struct apple_bce_device *dev)
+{
+    int i;
+    for (i = 0; i < dev->dma_vector_count; i++) {
+        if (READ_ONCE(dev->dma_vectors[i].drain_task) == current)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Waits until no completion pass can still be looking at a queue that was unpublished before. The SQ callbacks run
+ * inside the pass, waiting from one of them would never return, so that is refused.
+ */
+void bce_sync_queues(struct apple_bce_device *dev)
+{
+    if (WARN_ONCE(bce_in_completion_pass(dev), "bce: Queue teardown from a completion callback\n"))
+        return;
+    synchronize_srcu(&dev->queue_srcu);
+}
+
 struct bce_queue_cq *bce_alloc_cq(struct apple_bce_device *dev, int qid, u32 el_count)
 {
     struct bce_queue_cq *q;
+    if (!is_power_of_2(el_count)) {
+        pr_err("bce: CQ size %u is not a power of two\n", el_count);
+        return NULL;
+    }
     q = kzalloc(sizeof(struct bce_queue_cq), GFP_KERNEL);
     q->qid = qid;
     q->type = BCE_QUEUE_CQ;
     q->el_count = el_count;
-    q->data = dma_alloc_coherent(&dev->pci->dev, el_count * sizeof(struct bce_qe_completion),
-            &q->dma_handle, GFP_KERNEL);
+    q->el_mask = el_count - 1;
+    q->dev = dev;
+    bce_cq_set_budget(q, bce_cq_budget, bce_cq_doorbell_batch);
+    hrtimer_init(&q->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    q->poll_timer.function = bce_cq_poll_timer;
+    q->poll_interval_us = max(bce_cq_poll_interval_us, 1u);
+    q->data = bce_dma_alloc(dev, BCE_DMA_QUEUES, el_count * sizeof(struct bce_qe_completion), &q->dma_handle);
     if (!q->data) {
         pr_err("DMA queue memory alloc failed\n");
         kfree(q);
@@ -24,7 +97,7 @@ void bce_get_cq_memcfg(struct bce_queue_cq *cq, struct bce_queue_memcfg *cfg)
 {
     cfg->qid = (u16) cq->qid;
     cfg->el_count = (u16) cq->el_count;
-    cfg->vector_or_cq = 0;
+    cfg->vector_or_cq = (u16) cq->vector;
     cfg->_pad = 0;
     cfg->addr = cq->dma_handle;
     cfg->length = cq->el_count * sizeof(struct bce_qe_completion);
@@ -32,67 +105,207 @@ void bce_get_cq_memcfg(struct bce_queue_cq *cq, struct bce_queue_memcfg *cfg)
 
 void bce_free_cq(struct apple_bce_device *dev, struct bce_queue_cq *cq)
 {
-    dma_free_coherent(&dev->pci->dev, cq->el_count * sizeof(struct bce_qe_completion), cq->data, cq->dma_handle);
+    atomic_set(&cq->poll_users, 0);
+    hrtimer_cancel(&cq->poll_timer);
+    bce_dma_free(dev, BCE_DMA_QUEUES, cq->el_count * sizeof(struct bce_qe_completion), cq->data, cq->dma_handle);
     kfree(cq);
 }
 
-static void bce_handle_cq_completion(struct apple_bce_device *dev, struct bce_qe_completion *e, size_t *ce)
+static struct bce_queue_sq *bce_cq_target_sq(struct apple_bce_device *dev, struct bce_qe_completion *e)
 {
     struct bce_queue *target;
     struct bce_queue_sq *target_sq;
-    struct bce_sq_completion_data *cmpl;
     if (e->qid >= BCE_MAX_QUEUE_COUNT) {
         pr_err("Device sent a response for qid (%u) >= BCE_MAX_QUEUE_COUNT\n", e->qid);
-        return;
+        return NULL;
     }
-    target = dev->queues[e->qid];
+    target = srcu_dereference(dev->queues[e->qid], &dev->queue_srcu);
     if (!target || target->type != BCE_QUEUE_SQ) {
         pr_err("Device sent a response for qid (%u), which does not exist\n", e->qid);
-        return;
+        return NULL;
     }
     target_sq = (struct bce_queue_sq *) target;
     if (target_sq->completion_tail != e->completion_index) {
         pr_err("Completion index mismatch; this is likely going to make this driver unusable\n");
-        return;
+        return NULL;
     }
+    return target_sq;
+}
+
+static void bce_handle_cq_completion(struct bce_dma_vector *vec, struct bce_queue_sq *target_sq,
+        struct bce_qe_completion *e, size_t *ce)
+{
+    struct bce_sq_completion_data *cmpl;
     if (!target_sq->has_pending_completions) {
         target_sq->has_pending_completions = true;
-        dev->int_sq_list[(*ce)++] = target_sq;
+        vec->int_sq_list[(*ce)++] = target_sq;
     }
     cmpl = &target_sq->completion_data[e->completion_index];
     cmpl->status = e->status;
     cmpl->data_size = e->data_size;
     cmpl->result = e->result;
     wmb();
-    target_sq->completion_tail = (target_sq->completion_tail + 1) % target_sq->el_count;
+    target_sq->completion_tail = (target_sq->completion_tail + 1) & target_sq->el_mask;
+}
+
+/*
+ * Hands the run of pending completions for target_sq starting at the CQ index to its direct completion callback,
+ * in place. The run stops at the first entry for another SQ or out of order, at the end of the ring or after max
+ * entries; an out of order entry then gets reported by bce_cq_target_sq like on the copying path. Returns the length
+ * of the run; the caller releases the slots once the callback has returned.
+ */
+static u32 bce_handle_cq_direct_run(struct bce_queue_cq *cq, struct bce_queue_sq *target_sq, u32 max)
+{
+    struct bce_qe_completion *first = bce_cq_element(cq, cq->index);
+    u32 n = 1, pending = 1;
+    max = min(max, cq->el_count - cq->index);
+    while (pending < max && (READ_ONCE(first[pending].flags) & BCE_COMPLETION_FLAG_PENDING))
+        ++pending;
+    rmb();
+    while (n < pending && first[n].qid == target_sq->qid &&
+            first[n].completion_index == ((target_sq->completion_tail + n) & target_sq->el_mask))
+        ++n;
+    target_sq->completion_tail = (target_sq->completion_tail + n) & target_sq->el_mask;
+    target_sq->direct_completion(target_sq, first, n);
+    return n;
 }
 
-void bce_handle_cq_completions(struct apple_bce_device *dev, struct bce_queue_cq *cq)
+static __always_inline void bce_cq_write_doorbell(struct apple_bce_device *dev, struct bce_queue_cq *cq)
+{
+    mb();
+    iowrite32(cq->index, (u32 *) ((u8 *) dev->reg_mem_dma +  REG_DOORBELL_BASE) + cq->qid);
+}
+
+static void bce_cq_account_latency(struct bce_queue_cq *cq, struct bce_dma_vector *vec)
+{
+    struct bce_cq_latency *lat;
+    ktime_t kick;
+    u64 ns;
+    if (cq->poll_kick_time) {
+        kick = cq->poll_kick_time;
+        lat = &cq->latency_poll;
+        cq->poll_kick_time = 0;
+    } else if (vec->irq_time != cq->irq_seen_time) {
+        kick = vec->irq_time;
+        lat = &cq->latency_irq;
+    } else {
+        return; /* another pass for the same event */
+    }
+    cq->irq_seen_time = vec->irq_time;
+    ns = (u64) ktime_to_ns(ktime_sub(ktime_get(), kick));
+    ++lat->count;
+    lat->total_ns += ns;
+    lat->max_ns = max(lat->max_ns, ns);
+}
+
+static void bce_cq_poll_arm(struct bce_queue_cq *cq)
+{
+    if (atomic_read(&cq->poll_users) && !atomic_xchg(&cq->poll_armed, 1)) {
+        cq->poll_idle_ticks = 0;
+        hrtimer_start(&cq->poll_timer, us_to_ktime(cq->poll_interval_us), HRTIMER_MODE_REL);
+    }
+}
+
+/*
+ * The poll timer only looks at the pending flag and kicks the vector's interrupt thread; the completion callbacks
+ * themselves may sleep so they can't be run from the timer.
+ */
+static enum hrtimer_restart bce_cq_poll_timer(struct hrtimer *timer)
+{
+    struct bce_queue_cq *cq = container_of(timer, struct bce_queue_cq, poll_timer);
+    struct bce_dma_vector *vec = &cq->dev->dma_vectors[cq->vector];
+    struct bce_qe_completion *e = bce_cq_element(cq, READ_ONCE(cq->index));
+
+    if (READ_ONCE(e->flags) & BCE_COMPLETION_FLAG_PENDING) {
+        cq->poll_idle_ticks = 0;
+        if (!cq->poll_kick_time)
+            cq->poll_kick_time = ktime_get();
+        irq_wake_thread(vec->irq, vec);
+    } else if (++cq->poll_idle_ticks * cq->poll_interval_us >= BCE_CQ_POLL_IDLE_US) {
+        atomic_set(&cq->poll_armed, 0); /* idle, wait for the next interrupt to re-arm */
+        return HRTIMER_NORESTART;
+    }
+    if (!atomic_read(&cq->poll_users)) {
+        atomic_set(&cq->poll_armed, 0);
+        return HRTIMER_NORESTART;
+    }
+    hrtimer_forward_now(timer, us_to_ktime(cq->poll_interval_us));
+    return HRTIMER_RESTART;
+}
+
+void bce_cq_set_poll_interval(struct bce_queue_cq *cq, u32 interval_us)
+{
+    cq->poll_interval_us = max(interval_us, 1u);
+}
+
+/* Polls the CQ for completions while there is at least one user, e.g. a running stream */
+void bce_cq_poll_start(struct bce_queue_cq *cq)
+{
+    atomic_inc(&cq->poll_users);
+    bce_cq_poll_arm(cq);
+}
+
+void bce_cq_poll_stop(struct bce_queue_cq *cq)
+{
+    atomic_dec(&cq->poll_users); /* the timer stops itself on the next tick */
+}
+
+/* Drains up to cq->budget completions; returns true if the CQ still has pending completions afterwards */
+bool bce_handle_cq_completions(struct apple_bce_device *dev, struct bce_queue_cq *cq)
 {
     size_t ce = 0;
+    u32 done = 0, unacked = 0, n, i;
+    bool more;
     struct bce_qe_completion *e;
     struct bce_queue_sq *sq;
+    struct bce_dma_vector *vec = &dev->dma_vectors[cq->vector];
     e = bce_cq_element(cq, cq->index);
     if (!(e->flags & BCE_COMPLETION_FLAG_PENDING))
-        return;
+        return false;
     mb();
     while (true) {
         e = bce_cq_element(cq, cq->index);
-        if (!(e->flags & BCE_COMPLETION_FLAG_PENDING))
+        if (!(e->flags & BCE_COMPLETION_FLAG_PENDING) || done == cq->budget)
             break;
         // pr_info("bce: compl: %i: %i %llx %llx", e->qid, e->status, e->data_size, e->result);
-        bce_handle_cq_completion(dev, e, &ce);
-        e->flags = 0;
-        cq->index = (cq->index + 1) % cq->el_count;
+        n = 1;
+        sq = bce_cq_target_sq(dev, e);
+        if (sq && sq->direct_completion)
+            n = bce_handle_cq_direct_run(cq, sq, cq->budget - done);
+        else if (sq)
+            bce_handle_cq_completion(vec, sq, e, &ce);
+        for (i = 0; i < n; i++)
+            e[i].flags = 0;
+        cq->index = (cq->index + n) & cq->el_mask;
+        done += n;
+        /* Give the slots back to the device as we go instead of only at the end of a long burst */
+        unacked += n;
+        if (unacked >= cq->doorbell_batch) {
+            bce_cq_write_doorbell(dev, cq);
+            unacked = 0;
+        }
     }
-    mb();
-    iowrite32(cq->index, (u32 *) ((u8 *) dev->reg_mem_dma +  REG_DOORBELL_BASE) + cq->qid);
+    if (unacked)
+        bce_cq_write_doorbell(dev, cq);
+    more = (e->flags & BCE_COMPLETION_FLAG_PENDING) != 0;
+    ++cq->stat_passes;
+    if (more)
+        ++cq->stat_budget_exhausted;
+    bce_cq_account_latency(cq, vec);
+    bce_cq_poll_arm(cq);
     while (ce) {
         --ce;
-        sq = dev->int_sq_list[ce];
+        sq = vec->int_sq_list[ce];
         sq->completion(sq);
         sq->has_pending_completions = false;
     }
+    return more;
+}
+
+void bce_cq_set_budget(struct bce_queue_cq *cq, u32 budget, u32 doorbell_batch)
+{
+    cq->budget = max(budget, 1u);
+    cq->doorbell_batch = clamp(doorbell_batch, 1u, cq->budget);
 }
 
 
@@ -100,20 +313,25 @@ struct bce_queue_sq *bce_alloc_sq(struct apple_bce_device *dev, int qid, u32 el_
         bce_sq_completion compl, void *userdata)
 {
     struct bce_queue_sq *q;
+    if (!is_power_of_2(el_count)) {
+        pr_err("bce: SQ size %u is not a power of two\n", el_count);
+        return NULL;
+    }
     q = kzalloc(sizeof(struct bce_queue_sq), GFP_KERNEL);
     q->qid = qid;
     q->type = BCE_QUEUE_SQ;
     q->el_size = el_size;
     q->el_count = el_count;
-    q->data = dma_alloc_coherent(&dev->pci->dev, el_count * el_size,
-                                 &q->dma_handle, GFP_KERNEL);
+    q->el_mask = el_count - 1;
+    q->alloc_count = el_count;
+    q->data = bce_dma_alloc(dev, BCE_DMA_QUEUES, el_count * el_size, &q->dma_handle);
     q->completion = compl;
     q->userdata = userdata;
     q->completion_data = kzalloc(sizeof(struct bce_sq_completion_data) * el_count, GFP_KERNEL);
     q->reg_mem_dma = dev->reg_mem_dma;
-    atomic_set(&q->available_commands, el_count - 1);
-    init_completion(&q->available_command_completion);
-    atomic_set(&q->available_command_completion_waiting_count, 0);
+    q->dev = dev;
+    spin_lock_init(&q->doorbell_lock);
+    bce_sq_init_credits(q);
     if (!q->data) {
         pr_err("DMA queue memory alloc failed\n");
         kfree(q);
@@ -134,50 +352,320 @@ void bce_get_sq_memcfg(struct bce_queue_sq *sq, struct bce_queue_cq *cq, struct
 
 void bce_free_sq(struct apple_bce_device *dev, struct bce_queue_sq *sq)
 {
-    dma_free_coherent(&dev->pci->dev, sq->el_count * sq->el_size, sq->data, sq->dma_handle);
+    kfree(sq->mp_ready);
+    kfree(sq->completion_data);
+    bce_dma_free(dev, BCE_DMA_QUEUES, sq->alloc_count * sq->el_size, sq->data, sq->dma_handle);
     kfree(sq);
 }
 
+/*
+ * Submission credits. Takers that find enough credits and nobody waiting take them with a cmpxchg; everybody else
+ * queues up on credit_waiters and is served strictly in FIFO order by whoever returns credits, so a large
+ * reservation can't be starved by a stream of small ones.
+ */
+struct bce_sq_credit_waiter {
+    struct list_head list;
+    struct task_struct *task;
+    u32 count;
+    bool granted;
+};
+
+static void bce_sq_init_credits(struct bce_queue_sq *sq)
+{
+    atomic_set(&sq->available_commands, (int) sq->el_count - 1);
+    spin_lock_init(&sq->credit_lock);
+    INIT_LIST_HEAD(&sq->credit_waiters);
+}
+
+static bool bce_sq_take_credits(struct bce_queue_sq *sq, u32 count)
+{
+    int avail = atomic_read(&sq->available_commands);
+    do {
+        if (avail < (int) count)
+            return false;
+    } while (!atomic_try_cmpxchg(&sq->available_commands, &avail, avail - (int) count));
+    return true;
+}
+
+/* Must be called with credit_lock held */
+static void bce_sq_grant_credits(struct bce_queue_sq *sq)
+{
+    struct bce_sq_credit_waiter *w;
+    while (!list_empty(&sq->credit_waiters)) {
+        w = list_first_entry(&sq->credit_waiters, struct bce_sq_credit_waiter, list);
+        if (!bce_sq_take_credits(sq, w->count))
+            break;
+        list_del_init(&w->list);
+        WRITE_ONCE(w->granted, true);
+        wake_up_process(w->task);
+    }
+}
+
+static void bce_sq_account_wait(struct bce_queue_sq *sq, ktime_t start, bool timed_out)
+{
+    u64 ns = (u64) ktime_to_ns(ktime_sub(ktime_get(), start));
+    unsigned long flags;
+    spin_lock_irqsave(&sq->credit_lock, flags);
+    ++sq->stat_waits;
+    sq->stat_wait_total_ns += ns;
+    sq->stat_wait_max_ns = max(sq->stat_wait_max_ns, ns);
+    if (timed_out)
+        ++sq->stat_wait_timeouts;
+    spin_unlock_irqrestore(&sq->credit_lock, flags);
+}
+
+/* Reserves exactly count elements, either all of them or none */
+int bce_reserve_submissions(struct bce_queue_sq *sq, u32 count, unsigned long *timeout)
+{
+    struct bce_sq_credit_waiter w;
+    unsigned long flags;
+    ktime_t start;
+    bool granted;
+    if (count >= sq->el_count)
+        return -EINVAL;
+    if (list_empty(&sq->credit_waiters) && bce_sq_take_credits(sq, count))
+        return 0;
+    if (!timeout || !*timeout)
+        return -EAGAIN;
+
+    w.task = current;
+    w.count = count;
+    w.granted = false;
+    spin_lock_irqsave(&sq->credit_lock, flags);
+    list_add_tail(&w.list, &sq->credit_waiters);
+    smp_mb(); /* pairs with bce_cancel_submission_reservations: either it sees us queued or we see its credits */
+    bce_sq_grant_credits(sq);
+    spin_unlock_irqrestore(&sq->credit_lock, flags);
+
+    start = ktime_get();
+    bce_flush_plug(sq->dev);
+    while (true) {
+        set_current_state(TASK_UNINTERRUPTIBLE);
+        if (READ_ONCE(w.granted) || !*timeout)
+            break;
+        *timeout = schedule_timeout(*timeout);
+    }
+    __set_current_state(TASK_RUNNING);
+
+    spin_lock_irqsave(&sq->credit_lock, flags);
+    granted = w.granted;
+    if (!granted) {
+        /* Timed out; if we were at the head, the ones behind us may fit now */
+        list_del(&w.list);
+        bce_sq_grant_credits(sq);
+    }
+    spin_unlock_irqrestore(&sq->credit_lock, flags);
+    bce_sq_account_wait(sq, start, !granted);
+    return granted ? 0 : -EAGAIN;
+}
+
 int bce_reserve_submission(struct bce_queue_sq *sq, unsigned long *timeout)
 {
-    while (atomic_dec_if_positive(&sq->available_commands) < 0) {
-        if (!timeout || !*timeout)
-            return -EAGAIN;
-        atomic_inc(&sq->available_command_completion_waiting_count);
-        *timeout = wait_for_completion_timeout(&sq->available_command_completion, *timeout);
-        if (!*timeout) {
-            if (atomic_dec_if_positive(&sq->available_command_completion_waiting_count) < 0)
-                try_wait_for_completion(&sq->available_command_completion); /* consume the pending completion */
-        }
+    return bce_reserve_submissions(sq, 1, timeout);
+}
+
+/* Reserves one element on each of two SQs, or none at all */
+int bce_reserve_submission_pair(struct bce_queue_sq *a, struct bce_queue_sq *b, unsigned long *timeout)
+{
+    if (bce_reserve_submission(a, timeout))
+        return -EAGAIN;
+    if (bce_reserve_submission(b, timeout)) {
+        bce_cancel_submission_reservation(a);
+        return -EAGAIN;
     }
     return 0;
 }
 
 void bce_cancel_submission_reservation(struct bce_queue_sq *sq)
 {
-    atomic_inc(&sq->available_commands);
+    bce_cancel_submission_reservations(sq, 1);
 }
 
-void *bce_next_submission(struct bce_queue_sq *sq)
+/* Reserves up to max elements without waiting, returns the number of elements reserved */
+u32 bce_try_reserve_submissions(struct bce_queue_sq *sq, u32 max)
 {
-    void *ret = bce_sq_element(sq, sq->tail);
-    sq->tail = (sq->tail + 1) % sq->el_count;
-    return ret;
+    int avail = atomic_read(&sq->available_commands);
+    int take;
+    if (!list_empty(&sq->credit_waiters))
+        return 0; /* don't overtake the waiters */
+    do {
+        take = min_t(int, avail, max);
+        if (take <= 0)
+            return 0;
+    } while (!atomic_try_cmpxchg(&sq->available_commands, &avail, avail - take));
+    return (u32) take;
 }
 
-void bce_submit_to_device(struct bce_queue_sq *sq)
+void bce_cancel_submission_reservations(struct bce_queue_sq *sq, u32 count)
+{
+    unsigned long flags;
+    atomic_add((int) count, &sq->available_commands);
+    smp_mb__after_atomic();
+    if (list_empty(&sq->credit_waiters))
+        return;
+    spin_lock_irqsave(&sq->credit_lock, flags);
+    bce_sq_grant_credits(sq);
+    spin_unlock_irqrestore(&sq->credit_lock, flags);
+}
+
+static struct bce_sq_plug *bce_current_plug(struct apple_bce_device *dev)
 {
+    int i;
+    if (in_interrupt())
+        return NULL;
+    for (i = 0; i < BCE_MAX_PLUGS; i++) {
+        if (READ_ONCE(dev->plug_owners[i]) == current)
+            return dev->plugs[i];
+    }
+    return NULL;
+}
+
+static bool bce_plug_add(struct bce_sq_plug *plug, struct bce_queue_sq *sq)
+{
+    u32 i;
+    for (i = 0; i < plug->count; i++) {
+        if (plug->sqs[i] == sq)
+            return true;
+    }
+    if (plug->count == BCE_PLUG_MAX_SQS)
+        return false;
+    plug->sqs[plug->count++] = sq;
+    return true;
+}
+
+/* Must be called with doorbell_lock held */
+static void bce_sq_write_doorbell(struct bce_queue_sq *sq, u32 tail)
+{
+    sq->stat_submissions += (tail - sq->doorbell_tail) & sq->el_mask;
+    ++sq->stat_doorbells;
+    sq->doorbell_tail = tail;
     mb();
-    iowrite32(sq->tail, (u32 *) ((u8 *) sq->reg_mem_dma +  REG_DOORBELL_BASE) + sq->qid);
+    iowrite32(tail, (u32 *) ((u8 *) sq->reg_mem_dma +  REG_DOORBELL_BASE) + sq->qid);
 }
 
-void bce_notify_submission_complete(struct bce_queue_sq *sq)
+/* Publishes every element filled since the last call; a no-op if there are none */
+void bce_submit_to_device(struct bce_queue_sq *sq)
+{
+    unsigned long flags;
+    struct bce_sq_plug *plug = bce_current_plug(sq->dev);
+    spin_lock_irqsave(&sq->doorbell_lock, flags);
+    if (sq->multi_producer)
+        sq->tail = READ_ONCE(sq->mp_published) & sq->el_mask;
+    if (sq->tail != sq->doorbell_tail) {
+        if (plug && bce_plug_add(plug, sq)) {
+            sq->plug_tail = sq->tail;
+            sq->plug_gen = sq->stat_doorbells;
+        } else {
+            bce_sq_write_doorbell(sq, sq->tail);
+        }
+    }
+    spin_unlock_irqrestore(&sq->doorbell_lock, flags);
+}
+
+/* Must be called before anything is submitted to the SQ; bce_next_submission can't be used afterwards */
+int bce_sq_enable_multi_producer(struct bce_queue_sq *sq)
 {
-    sq->head = (sq->head + 1) % sq->el_count;
-    atomic_inc(&sq->available_commands);
-    if (atomic_dec_if_positive(&sq->available_command_completion_waiting_count) >= 0) {
-        complete(&sq->available_command_completion);
+    u32 i;
+    sq->mp_ready = kcalloc(sq->el_count, sizeof(u32), GFP_KERNEL);
+    if (!sq->mp_ready)
+        return -ENOMEM;
+    /* Make every slot look like it was last filled a lap before the first ticket */
+    for (i = 0; i < sq->el_count; i++)
+        sq->mp_ready[i] = sq->tail + i - sq->el_count;
+    atomic_set(&sq->mp_claim, (int) sq->tail);
+    sq->mp_published = sq->tail;
+    sq->multi_producer = true;
+    return 0;
+}
+
+/*
+ * Must be called before anything is submitted to the SQ. The completions are then handed to compl in place instead
+ * of being copied into completion_data, so bce_next_completion can't be used afterwards.
+ */
+void bce_sq_enable_direct_completion(struct bce_queue_sq *sq, bce_sq_direct_completion compl)
+{
+    kfree(sq->completion_data);
+    sq->completion_data = NULL;
+    sq->direct_completion = compl;
+}
+
+/* The caller must already hold a reservation, which guarantees that the slot is free */
+u32 bce_mp_claim_submission(struct bce_queue_sq *sq)
+{
+    return (u32) atomic_fetch_inc(&sq->mp_claim);
+}
+
+void bce_mp_publish_submission(struct bce_queue_sq *sq, u32 ticket)
+{
+    u32 pos;
+    smp_store_release(&sq->mp_ready[bce_mp_slot(sq, ticket)], ticket);
+    smp_mb(); /* pairs with the cmpxchg below: either we see the earlier tickets' publisher advance, or it sees us */
+
+    /* Advance the published prefix over every consecutive filled ticket, including the ones of other producers */
+    pos = READ_ONCE(sq->mp_published);
+    while (smp_load_acquire(&sq->mp_ready[bce_mp_slot(sq, pos)]) == pos) {
+        if (cmpxchg(&sq->mp_published, pos, pos + 1) == pos)
+            ++pos;
+        else
+            pos = READ_ONCE(sq->mp_published);
     }
+    bce_submit_to_device(sq);
+}
+
+void bce_start_plug(struct apple_bce_device *dev, struct bce_sq_plug *plug)
+{
+    int i;
+    plug->count = 0;
+    plug->slot = -1;
+    if (in_interrupt() || bce_current_plug(dev))
+        return; /* nested plugs are folded into the outermost one */
+    for (i = 0; i < BCE_MAX_PLUGS; i++) {
+        if (!cmpxchg(&dev->plug_owners[i], NULL, current)) {
+            dev->plugs[i] = plug;
+            plug->slot = i;
+            return;
+        }
+    }
+}
+
+static void __bce_flush_plug(struct bce_sq_plug *plug)
+{
+    unsigned long flags;
+    struct bce_queue_sq *sq;
+    u32 i;
+    for (i = 0; i < plug->count; i++) {
+        sq = plug->sqs[i];
+        spin_lock_irqsave(&sq->doorbell_lock, flags);
+        /* If somebody rang the doorbell since, they published a tail that includes our elements */
+        if (sq->plug_gen == sq->stat_doorbells && sq->plug_tail != sq->doorbell_tail)
+            bce_sq_write_doorbell(sq, sq->plug_tail);
+        spin_unlock_irqrestore(&sq->doorbell_lock, flags);
+    }
+    plug->count = 0;
+}
+
+void bce_finish_plug(struct apple_bce_device *dev, struct bce_sq_plug *plug)
+{
+    if (plug->slot < 0)
+        return;
+    __bce_flush_plug(plug);
+    dev->plugs[plug->slot] = NULL;
+    smp_store_release(&dev->plug_owners[plug->slot], NULL);
+    plug->slot = -1;
+}
+
+/* Writes the pending doorbells of the current task's plug, if it has one */
+void bce_flush_plug(struct apple_bce_device *dev)
+{
+    struct bce_sq_plug *plug = bce_current_plug(dev);
+    if (plug)
+        __bce_flush_plug(plug);
+}
+
+void bce_notify_submission_complete(struct bce_queue_sq *sq)
+{
+    sq->head = (sq->head + 1) & sq->el_mask;
+    bce_cancel_submission_reservations(sq, 1);
 }
 
 void bce_set_submission_single(struct bce_qe_submission *element, dma_addr_t addr, size_t size)
@@ -187,6 +675,59 @@ void bce_set_submission_single(struct bce_qe_submission *element, dma_addr_t add
     element->segl_addr = element->segl_length = 0;
 }
 
+#ifdef BCE_RING_BENCH
+/*
+ * Measures the host side cost of the ring operations (reserve, fill, completion write, retire) on a ring that is
+ * not registered with the device, so the doorbell MMIO writes are left out. Returns the average ns per element.
+ */
+u64 bce_sq_ring_bench(u32 iterations, u32 batch)
+{
+    struct bce_queue_sq *sq;
+    struct bce_sq_completion_data *c;
+    ktime_t start;
+    u32 i, j, n;
+    u64 ns = 0;
+    sq = kzalloc(sizeof(struct bce_queue_sq), GFP_KERNEL);
+    if (!sq)
+        return 0;
+    sq->el_size = sizeof(struct bce_qe_submission);
+    sq->el_count = 256;
+    sq->el_mask = sq->el_count - 1;
+    sq->data = kcalloc(sq->el_count, sq->el_size, GFP_KERNEL);
+    sq->completion_data = kcalloc(sq->el_count, sizeof(struct bce_sq_completion_data), GFP_KERNEL);
+    if (!sq->data || !sq->completion_data || !batch || batch >= sq->el_count)
+        goto out;
+    bce_sq_init_credits(sq);
+
+    start = ktime_get();
+    for (i = 0; i < iterations; i += batch) {
+        if (bce_reserve_submissions(sq, batch, NULL))
+            goto out;
+        for (j = 0; j < batch; j++)
+            bce_set_submission_single(bce_next_submission(sq), (dma_addr_t) j, 0x40);
+        /* what bce_handle_cq_completion does for each of them */
+        for (j = 0; j < batch; j++) {
+            sq->completion_data[sq->completion_tail].status = BCE_COMPLETION_SUCCESS;
+            sq->completion_tail = (sq->completion_tail + 1) & sq->el_mask;
+        }
+        n = 0;
+        while ((c = bce_next_completion(sq))) {
+            n += c->status == BCE_COMPLETION_SUCCESS;
+            bce_notify_submission_complete(sq);
+        }
+        if (n != batch)
+            goto out;
+    }
+    ns = div_u64((u64) ktime_to_ns(ktime_sub(ktime_get(), start)), max(iterations, 1u));
+
+out:
+    kfree(sq->completion_data);
+    kfree(sq->data);
+    kfree(sq);
+    return ns;
+}
+#endif
+
 static void bce_cmdq_completion(struct bce_queue_sq *q);
 
 struct bce_queue_cmdq *bce_alloc_cmdq(struct apple_bce_device *dev, int qid, u32 el_count)
@@ -200,7 +741,9 @@ struct bce_queue_cmdq *bce_alloc_cmdq(struct apple_bce_device *dev, int qid, u32
     }
     spin_lock_init(&q->lck);
     q->tres = kzalloc(sizeof(struct bce_queue_cmdq_result_el*) * el_count, GFP_KERNEL);
-    if (!q->tres) {
+    if (!q->tres || bce_sq_enable_multi_producer(q->sq)) {
+        kfree(q->tres);
+        bce_free_sq(dev, q->sq);
         kfree(q);
         return NULL;
     }
@@ -223,52 +766,85 @@ void bce_cmdq_completion(struct bce_queue_sq *q)
     spin_lock(&cmdq->lck);
     while ((result = bce_next_completion(q))) {
         el = cmdq->tres[cmdq->sq->head];
+        cmdq->tres[cmdq->sq->head] = NULL;
         if (el) {
             el->result = result->result;
             el->status = result->status;
-            mb();
-            complete(&el->cmpl);
-        } else {
-            pr_err("bce: Unexpected command queue completion\n");
         }
-        cmdq->tres[cmdq->sq->head] = NULL;
         bce_notify_submission_complete(q);
+        if (!el) {
+            pr_err("bce: Unexpected command queue completion\n");
+            continue;
+        }
+        spin_unlock(&cmdq->lck);
+        mb();
+        /* An async command's callback owns the result element, so it must not be touched after calling it */
+        if (el->callback)
+            el->callback(el, el->callback_data);
+        else
+            complete(&el->cmpl);
+        spin_lock(&cmdq->lck);
     }
     spin_unlock(&cmdq->lck);
 }
 
-static __always_inline void *bce_cmd_start(struct bce_queue_cmdq *cmdq, struct bce_queue_cmdq_result_el *res)
+static __always_inline void *bce_cmd_start(struct bce_queue_cmdq *cmdq, struct bce_queue_cmdq_result_el *res,
+        bce_cmd_callback cb, void *cb_data)
 {
     void *ret;
     unsigned long timeout;
     init_completion(&res->cmpl);
+    res->callback = cb;
+    res->callback_data = cb_data;
     mb();
 
     timeout = msecs_to_jiffies(1000L * 60 * 5); /* wait for up to ~5 minutes */
     if (bce_reserve_submission(cmdq->sq, &timeout))
         return NULL;
 
+    res->ticket = bce_mp_claim_submission(cmdq->sq);
     spin_lock(&cmdq->lck);
-    cmdq->tres[cmdq->sq->tail] = res;
-    ret = bce_next_submission(cmdq->sq);
+    cmdq->tres[bce_mp_slot(cmdq->sq, res->ticket)] = res;
+    spin_unlock(&cmdq->lck);
+    ret = bce_cmdq_element(cmdq->sq, bce_mp_slot(cmdq->sq, res->ticket));
     return ret;
 }
 
-static __always_inline void bce_cmd_finish(struct bce_queue_cmdq *cmdq, struct bce_queue_cmdq_result_el *res)
+static __always_inline void bce_cmd_submit(struct bce_queue_cmdq *cmdq, struct bce_queue_cmdq_result_el *res)
 {
-    bce_submit_to_device(cmdq->sq);
-    spin_unlock(&cmdq->lck);
+    bce_mp_publish_submission(cmdq->sq, res->ticket);
+}
 
-    wait_for_completion(&res->cmpl);
+/*
+ * Waits for an async command submitted without a callback. If the timeout expires first, the command is abandoned:
+ * its late completion is dropped and (u32) -1 is returned, so that res can go away.
+ */
+u32 bce_cmd_wait(struct bce_queue_cmdq *cmdq, struct bce_queue_cmdq_result_el *res, unsigned long timeout)
+{
+    u32 slot = bce_mp_slot(cmdq->sq, res->ticket);
+    bool abandoned = false;
+    bce_flush_plug(cmdq->sq->dev);
+    if (!wait_for_completion_timeout(&res->cmpl, timeout)) {
+        spin_lock(&cmdq->lck);
+        if (cmdq->tres[slot] == res) {
+            cmdq->tres[slot] = NULL;
+            abandoned = true;
+        }
+        spin_unlock(&cmdq->lck);
+        if (abandoned)
+            return (u32) -1;
+        wait_for_completion(&res->cmpl); /* it is being completed right now */
+    }
     mb();
+    return res->status;
 }
 
-u32 bce_cmd_register_queue(struct bce_queue_cmdq *cmdq, struct bce_queue_memcfg *cfg, const char *name, bool isdirout)
+int bce_cmd_register_queue_async(struct bce_queue_cmdq *cmdq, struct bce_queue_memcfg *cfg, const char *name,
+        bool isdirout, struct bce_queue_cmdq_result_el *res, bce_cmd_callback cb, void *cb_data)
 {
-    struct bce_queue_cmdq_result_el res;
-    struct bce_cmdq_register_memory_queue_cmd *cmd = bce_cmd_start(cmdq, &res);
+    struct bce_cmdq_register_memory_queue_cmd *cmd = bce_cmd_start(cmdq, res, cb, cb_data);
     if (!cmd)
-        return (u32) -1;
+        return -EAGAIN;
     cmd->cmd = BCE_CMD_REGISTER_MEMORY_QUEUE;
     cmd->flags = (u16) ((name ? 2 : 0) | (isdirout ? 1 : 0));
     cmd->qid = cfg->qid;
@@ -284,38 +860,61 @@ u32 bce_cmd_register_queue(struct bce_queue_cmdq *cmdq, struct bce_queue_memcfg
     cmd->addr = cfg->addr;
     cmd->length = cfg->length;
 
-    bce_cmd_finish(cmdq, &res);
-    return res.status;
+    bce_cmd_submit(cmdq, res);
+    return 0;
 }
 
-u32 bce_cmd_unregister_memory_queue(struct bce_queue_cmdq *cmdq, u16 qid)
+static int bce_cmd_simple_memory_queue_async(struct bce_queue_cmdq *cmdq, u16 command, u16 qid,
+        struct bce_queue_cmdq_result_el *res, bce_cmd_callback cb, void *cb_data)
 {
-    struct bce_queue_cmdq_result_el res;
-    struct bce_cmdq_simple_memory_queue_cmd *cmd = bce_cmd_start(cmdq, &res);
+    struct bce_cmdq_simple_memory_queue_cmd *cmd = bce_cmd_start(cmdq, res, cb, cb_data);
     if (!cmd)
-        return (u32) -1;
-    cmd->cmd = BCE_CMD_UNREGISTER_MEMORY_QUEUE;
+        return -EAGAIN;
+    cmd->cmd = command;
     cmd->flags = 0;
     cmd->qid = qid;
-    bce_cmd_finish(cmdq, &res);
-    return res.status;
+    bce_cmd_submit(cmdq, res);
+    return 0;
 }
 
-u32 bce_cmd_flush_memory_queue(struct bce_queue_cmdq *cmdq, u16 qid)
+int bce_cmd_unregister_memory_queue_async(struct bce_queue_cmdq *cmdq, u16 qid, struct bce_queue_cmdq_result_el *res,
+        bce_cmd_callback cb, void *cb_data)
+{
+    return bce_cmd_simple_memory_queue_async(cmdq, BCE_CMD_UNREGISTER_MEMORY_QUEUE, qid, res, cb, cb_data);
+}
+
+int bce_cmd_flush_memory_queue_async(struct bce_queue_cmdq *cmdq, u16 qid, struct bce_queue_cmdq_result_el *res,
+        bce_cmd_callback cb, void *cb_data)
+{
+    return bce_cmd_simple_memory_queue_async(cmdq, BCE_CMD_FLUSH_MEMORY_QUEUE, qid, res, cb, cb_data);
+}
+
+u32 bce_cmd_register_queue(struct bce_queue_cmdq *cmdq, struct bce_queue_memcfg *cfg, const char *name, bool isdirout)
 {
     struct bce_queue_cmdq_result_el res;
-    struct bce_cmdq_simple_memory_queue_cmd *cmd = bce_cmd_start(cmdq, &res);
-    if (!cmd)
+    if (bce_cmd_register_queue_async(cmdq, cfg, name, isdirout, &res, NULL, NULL))
         return (u32) -1;
-    cmd->cmd = BCE_CMD_FLUSH_MEMORY_QUEUE;
-    cmd->flags = 0;
-    cmd->qid = qid;
-    bce_cmd_finish(cmdq, &res);
-    return res.status;
+    return bce_cmd_wait(cmdq, &res, MAX_SCHEDULE_TIMEOUT);
+}
+
+u32 bce_cmd_unregister_memory_queue(struct bce_queue_cmdq *cmdq, u16 qid)
+{
+    struct bce_queue_cmdq_result_el res;
+    if (bce_cmd_unregister_memory_queue_async(cmdq, qid, &res, NULL, NULL))
+        return (u32) -1;
+    return bce_cmd_wait(cmdq, &res, MAX_SCHEDULE_TIMEOUT);
 }
 
+u32 bce_cmd_flush_memory_queue(struct bce_queue_cmdq *cmdq, u16 qid)
+{
+    struct bce_queue_cmdq_result_el res;
+    if (bce_cmd_flush_memory_queue_async(cmdq, qid, &res, NULL, NULL))
+        return (u32) -1;
+    return bce_cmd_wait(cmdq, &res, MAX_SCHEDULE_TIMEOUT);
+}
 
-struct bce_queue_cq *bce_create_cq(struct apple_bce_device *dev, u32 el_count)
+/* Allocates a CQ and registers it with the firmware for the given vector, without publishing it */
+static struct bce_queue_cq *bce_register_new_cq(struct apple_bce_device *dev, u32 el_count, int vector)
 {
     struct bce_queue_cq *cq;
     struct bce_queue_memcfg cfg;
@@ -323,8 +922,11 @@ struct bce_queue_cq *bce_create_cq(struct apple_bce_device *dev, u32 el_count)
     if (qid < 0)
         return NULL;
     cq = bce_alloc_cq(dev, qid, el_count);
-    if (!cq)
+    if (!cq) {
+        ida_simple_remove(&dev->queue_ida, (uint) qid);
         return NULL;
+    }
+    cq->vector = vector;
     bce_get_cq_memcfg(cq, &cfg);
     if (bce_cmd_register_queue(dev->cmd_cmdq, &cfg, NULL, false) != 0) {
         pr_err("bce: CQ registration failed (%i)", qid);
@@ -332,7 +934,156 @@ struct bce_queue_cq *bce_create_cq(struct apple_bce_device *dev, u32 el_count)
         ida_simple_remove(&dev->queue_ida, (uint) qid);
         return NULL;
     }
-    dev->queues[qid] = (struct bce_queue *) cq;
+    return cq;
+}
+
+static struct bce_queue_sq *bce_alloc_new_sq(struct apple_bce_device *dev, u32 el_count, bce_sq_completion compl,
+        void *userdata)
+{
+    struct bce_queue_sq *sq;
+    int qid = ida_simple_get(&dev->queue_ida, BCE_QUEUE_USER_MIN, BCE_QUEUE_USER_MAX, GFP_KERNEL);
+    if (qid < 0)
+        return NULL;
+    sq = bce_alloc_sq(dev, qid, sizeof(struct bce_qe_submission), el_count, compl, userdata);
+    if (!sq)
+        ida_simple_remove(&dev->queue_ida, (uint) qid);
+    return sq;
+}
+
+/* Every pooled queue holds a qid out of the small user range, so only keep a single set ready by default */
+static uint bce_queue_pool_size = 1;
+module_param_named(queue_pool_size, bce_queue_pool_size, uint, 0444);
+MODULE_PARM_DESC(queue_pool_size, "Number of registered CQs per DMA vector (and twice as many allocated SQs) kept ready for new endpoints");
+
+static void bce_queue_pool_refill_w(struct work_struct *work)
+{
+    struct bce_queue_pool *pool = container_of(work, struct bce_queue_pool, refill_work);
+    struct apple_bce_device *dev = container_of(pool, struct apple_bce_device, queue_pool);
+    struct bce_queue_cq *cq;
+    struct bce_queue_sq *sq;
+    int i;
+    for (i = 0; i < dev->dma_vector_count; i++) {
+        while (!dev->is_being_removed && READ_ONCE(pool->cq_count[i]) < pool->target) {
+            if (!(cq = bce_register_new_cq(dev, BCE_POOL_CQ_MAX_EL_COUNT, i)))
+                return;
+            mutex_lock(&pool->lock);
+            list_add_tail(&cq->list, &pool->cqs[i]);
+            ++pool->cq_count[i];
+            mutex_unlock(&pool->lock);
+        }
+    }
+    while (!dev->is_being_removed && READ_ONCE(pool->sq_count) < 2 * pool->target) {
+        if (!(sq = bce_alloc_new_sq(dev, BCE_POOL_SQ_MAX_EL_COUNT, NULL, NULL)))
+            return;
+        mutex_lock(&pool->lock);
+        list_add_tail(&sq->pool_list, &pool->sqs);
+        ++pool->sq_count;
+        mutex_unlock(&pool->lock);
+    }
+}
+
+void bce_queue_pool_init(struct apple_bce_device *dev)
+{
+    struct bce_queue_pool *pool = &dev->queue_pool;
+    int i;
+    mutex_init(&pool->lock);
+    pool->target = min(bce_queue_pool_size, 32u);
+    for (i = 0; i < BCE_MAX_DMA_VECTORS; i++)
+        INIT_LIST_HEAD(&pool->cqs[i]);
+    INIT_LIST_HEAD(&pool->sqs);
+    INIT_WORK(&pool->refill_work, bce_queue_pool_refill_w);
+    if (pool->target)
+        schedule_work(&pool->refill_work);
+}
+
+void bce_queue_pool_destroy(struct apple_bce_device *dev)
+{
+    struct bce_queue_pool *pool = &dev->queue_pool;
+    struct bce_queue_cq *cq, *cqt;
+    struct bce_queue_sq *sq, *sqt;
+    int i;
+    cancel_work_sync(&pool->refill_work);
+    for (i = 0; i < BCE_MAX_DMA_VECTORS; i++) {
+        list_for_each_entry_safe(cq, cqt, &pool->cqs[i], list) {
+            if (!dev->is_being_removed && bce_cmd_unregister_memory_queue(dev->cmd_cmdq, (u16) cq->qid))
+                pr_err("bce: CQ unregister failed");
+            ida_simple_remove(&dev->queue_ida, (uint) cq->qid);
+            bce_free_cq(dev, cq);
+        }
+        INIT_LIST_HEAD(&pool->cqs[i]);
+        pool->cq_count[i] = 0;
+    }
+    list_for_each_entry_safe(sq, sqt, &pool->sqs, pool_list) {
+        ida_simple_remove(&dev->queue_ida, (uint) sq->qid);
+        bce_free_sq(dev, sq);
+    }
+    INIT_LIST_HEAD(&pool->sqs);
+    pool->sq_count = 0;
+}
+
+static struct bce_queue_cq *bce_queue_pool_take_cq(struct apple_bce_device *dev, u32 el_count, int vector)
+{
+    struct bce_queue_pool *pool = &dev->queue_pool;
+    struct bce_queue_cq *cq = NULL;
+    if (el_count > BCE_POOL_CQ_MAX_EL_COUNT)
+        return NULL;
+    mutex_lock(&pool->lock);
+    if (!list_empty(&pool->cqs[vector])) {
+        cq = list_first_entry(&pool->cqs[vector], struct bce_queue_cq, list);
+        list_del(&cq->list);
+        --pool->cq_count[vector];
+    }
+    mutex_unlock(&pool->lock);
+    if (cq)
+        schedule_work(&pool->refill_work);
+    return cq;
+}
+
+static struct bce_queue_sq *bce_queue_pool_take_sq(struct apple_bce_device *dev, u32 el_count)
+{
+    struct bce_queue_pool *pool = &dev->queue_pool;
+    struct bce_queue_sq *sq = NULL;
+    if (el_count > BCE_POOL_SQ_MAX_EL_COUNT || !is_power_of_2(el_count))
+        return NULL;
+    mutex_lock(&pool->lock);
+    if (!list_empty(&pool->sqs)) {
+        sq = list_first_entry(&pool->sqs, struct bce_queue_sq, pool_list);
+        list_del(&sq->pool_list);
+        --pool->sq_count;
+    }
+    mutex_unlock(&pool->lock);
+    if (!sq)
+        return NULL;
+    schedule_work(&pool->refill_work);
+    /* Not registered yet, so the ring can still be cut down to the front of its memory */
+    sq->el_count = el_count;
+    sq->el_mask = el_count - 1;
+    bce_sq_init_credits(sq);
+    return sq;
+}
+
+static void bce_queue_pool_account(struct bce_queue_pool_stat *stat, bool hit, ktime_t start)
+{
+    /* Concurrent creators don't share a lock here */
+    atomic64_inc(hit ? &stat->hits : &stat->misses);
+    atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)), &stat->total_ns);
+}
+
+struct bce_queue_cq *bce_create_cq(struct apple_bce_device *dev, u32 el_count, enum bce_cq_vector_hint vector)
+{
+    struct bce_queue_cq *cq;
+    ktime_t start = ktime_get();
+    int vec = (int) vector % dev->dma_vector_count;
+    bool hit = true;
+    cq = bce_queue_pool_take_cq(dev, el_count, vec);
+    if (!cq) {
+        hit = false;
+        cq = bce_register_new_cq(dev, el_count, vec);
+        if (!cq)
+            return NULL;
+    }
+    bce_publish_queue(dev, (struct bce_queue *) cq);
+    bce_queue_pool_account(&dev->queue_pool.cq_stat, hit, start);
     return cq;
 }
 
@@ -341,27 +1092,34 @@ struct bce_queue_sq *bce_create_sq(struct apple_bce_device *dev, struct bce_queu
 {
     struct bce_queue_sq *sq;
     struct bce_queue_memcfg cfg;
-    int qid;
+    ktime_t start = ktime_get();
+    bool hit = true;
     if (cq == NULL)
         return NULL; /* cq can not be null */
     if (name == NULL)
         return NULL; /* name can not be null */
     if (direction != DMA_TO_DEVICE && direction != DMA_FROM_DEVICE)
         return NULL; /* unsupported direction */
-    qid = ida_simple_get(&dev->queue_ida, BCE_QUEUE_USER_MIN, BCE_QUEUE_USER_MAX, GFP_KERNEL);
-    if (qid < 0)
-        return NULL;
-    sq = bce_alloc_sq(dev, qid, sizeof(struct bce_qe_submission), el_count, compl, userdata);
-    if (!sq)
-        return NULL;
+    sq = bce_queue_pool_take_sq(dev, el_count);
+    if (sq) {
+        sq->completion = compl;
+        sq->userdata = userdata;
+    } else {
+        hit = false;
+        sq = bce_alloc_new_sq(dev, el_count, compl, userdata);
+        if (!sq)
+            return NULL;
+    }
+    /* The name is only known now, so this round-trip can't be done ahead of time */
     bce_get_sq_memcfg(sq, cq, &cfg);
     if (bce_cmd_register_queue(dev->cmd_cmdq, &cfg, name, direction != DMA_FROM_DEVICE) != 0) {
-        pr_err("bce: SQ registration failed (%i)", qid);
+        pr_err("bce: SQ registration failed (%i)", sq->qid);
+        ida_simple_remove(&dev->queue_ida, (uint) sq->qid);
         bce_free_sq(dev, sq);
-        ida_simple_remove(&dev->queue_ida, (uint) qid);
         return NULL;
     }
-    dev->queues[qid] = (struct bce_queue *) sq;
+    bce_publish_queue(dev, (struct bce_queue *) sq);
+    bce_queue_pool_account(&dev->queue_pool.sq_stat, hit, start);
     return sq;
 }
 
@@ -369,14 +1127,17 @@ void bce_destroy_cq(struct apple_bce_device *dev, struct bce_queue_cq *cq)
 {
     if (!dev->is_being_removed && bce_cmd_unregister_memory_queue(dev->cmd_cmdq, (u16) cq->qid))
         pr_err("bce: CQ unregister failed");
+    bce_unpublish_queue(dev, (struct bce_queue *) cq);
     ida_simple_remove(&dev->queue_ida, (uint) cq->qid);
     bce_free_cq(dev, cq);
 }
 
 void bce_destroy_sq(struct apple_bce_device *dev, struct bce_queue_sq *sq)
 {
+    bce_flush_plug(dev); /* don't leave a freed SQ on our own plug */
     if (!dev->is_being_removed && bce_cmd_unregister_memory_queue(dev->cmd_cmdq, (u16) sq->qid))
         pr_err("bce: CQ unregister failed");
+    bce_unpublish_queue(dev, (struct bce_queue *) sq);
     ida_simple_remove(&dev->queue_ida, (uint) sq->qid);
     bce_free_sq(dev, sq);
 }
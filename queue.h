@@ -2,6 +2,7 @@
 #define BCE_QUEUE_H
 
 #include <linux/completion.h>
+#include <linux/hrtimer.h>
 #include <linux/pci.h>
 
 #define BCE_CMD_SIZE 0x40
@@ -11,21 +12,59 @@ struct apple_bce_device;
 enum bce_queue_type {
     BCE_QUEUE_CQ, BCE_QUEUE_SQ
 };
+/* Traffic classes used to spread CQs over the available DMA vectors */
+enum bce_cq_vector_hint {
+    BCE_CQ_VECTOR_DEFAULT = 0,
+    BCE_CQ_VECTOR_AUDIO,
+    BCE_CQ_VECTOR_INTERRUPT,
+    BCE_CQ_VECTOR_BULK
+};
 struct bce_queue {
     int qid;
     int type;
 };
+struct bce_cq_latency {
+    u64 count;
+    u64 total_ns;
+    u64 max_ns;
+};
+/*
+ * The ring structs are split into cache lines by who writes them: read-mostly setup state, the consumer/producer
+ * indices and, for SQs, the completion state written by the CQ handler. All rings have power-of-two sizes.
+ */
 struct bce_queue_cq {
     int qid;
     int type;
+    struct list_head list;
+    struct apple_bce_device *dev;
+    int vector;
     u32 el_count;
+    u32 el_mask;
     dma_addr_t dma_handle;
     void *data;
+    u32 budget;         /* max completions per pass before other CQs get a turn */
+    u32 doorbell_batch; /* completions consumed between doorbell writes */
+
+    /* Consumer, only touched by the vector's interrupt thread */
+    u32 index ____cacheline_aligned_in_smp;
+    u64 stat_passes;
+    u64 stat_budget_exhausted;
+    ktime_t irq_seen_time;
+    struct bce_cq_latency latency_irq, latency_poll;
 
-    u32 index;
+    /* Optional busy-poll mode, see bce_cq_poll_start */
+    struct hrtimer poll_timer ____cacheline_aligned_in_smp;
+    u32 poll_interval_us;
+    u32 poll_idle_ticks;
+    atomic_t poll_users;
+    atomic_t poll_armed;
+    ktime_t poll_kick_time; /* when the poll timer first saw the pending completion, 0 if it didn't */
 };
 struct bce_queue_sq;
+struct bce_qe_completion;
 typedef void (*bce_sq_completion)(struct bce_queue_sq *q);
+/* Gets count consecutive completions of the SQ, still in the CQ ring; the slots are released once it returns */
+typedef void (*bce_sq_direct_completion)(struct bce_queue_sq *q, struct bce_qe_completion *e, u32 count);
 struct bce_sq_completion_data {
     u32 status;
     u64 data_size;
@@ -34,32 +73,76 @@ struct bce_sq_completion_data {
 struct bce_queue_sq {
     int qid;
     int type;
+    struct list_head pool_list;
     u32 el_size;
     u32 el_count;
+    u32 el_mask;
+    u32 alloc_count; /* what data and completion_data hold, more than el_count if it came from the queue pool */
     dma_addr_t dma_handle;
     void *data;
     void *userdata;
     void __iomem *reg_mem_dma;
+    struct apple_bce_device *dev;
+    struct bce_sq_completion_data *completion_data; /* NULL in direct completion mode */
+    bce_sq_completion completion;
+    bce_sq_direct_completion direct_completion;
+
+    /* Producer */
+    atomic_t available_commands ____cacheline_aligned_in_smp;
+    spinlock_t credit_lock;
+    struct list_head credit_waiters; /* FIFO of tasks waiting for credits */
+    u64 stat_waits;
+    u64 stat_wait_timeouts;
+    u64 stat_wait_total_ns;
+    u64 stat_wait_max_ns;
+    u32 tail;
+    spinlock_t doorbell_lock;
+    u32 doorbell_tail; /* the tail last written to the doorbell */
+    u32 plug_tail; /* the tail to publish when the plug holding this SQ is finished */
+    u64 plug_gen; /* stat_doorbells at the time plug_tail was recorded */
+    u64 stat_submissions;
+    u64 stat_doorbells;
 
-    atomic_t available_commands;
-    struct completion available_command_completion;
-    atomic_t available_command_completion_waiting_count;
-    u32 head, tail;
+    /* Multi-producer mode, see bce_sq_enable_multi_producer */
+    bool multi_producer;
+    atomic_t mp_claim ____cacheline_aligned_in_smp; /* next ticket to hand out */
+    u32 mp_published; /* all tickets below this one are filled */
+    u32 *mp_ready; /* per slot, the last ticket filled in it */
 
-    u32 completion_cidx, completion_tail;
-    struct bce_sq_completion_data *completion_data;
+    /* Consumer, i.e. the completion callback */
+    u32 head ____cacheline_aligned_in_smp;
+    u32 completion_cidx;
+
+    /* Completion writer, i.e. the CQ handler */
+    u32 completion_tail ____cacheline_aligned_in_smp;
     bool has_pending_completions;
-    bce_sq_completion completion;
 };
 
+/*
+ * While a task has a plug started, bce_submit_to_device only marks the SQ dirty; the doorbells of all the dirty SQs
+ * are written by bce_finish_plug. Anything that sleeps waiting on the device while plugged must call bce_flush_plug.
+ */
+#define BCE_PLUG_MAX_SQS 32
+struct bce_sq_plug {
+    int slot;
+    u32 count;
+    struct bce_queue_sq *sqs[BCE_PLUG_MAX_SQS];
+};
+
+struct bce_queue_cmdq_result_el;
+/* Called from the completion path, must not sleep */
+typedef void (*bce_cmd_callback)(struct bce_queue_cmdq_result_el *res, void *data);
 struct bce_queue_cmdq_result_el {
     struct completion cmpl;
     u32 status;
     u64 result;
+    u32 ticket;
+    bce_cmd_callback callback;
+    void *callback_data;
 };
 struct bce_queue_cmdq {
-    struct bce_queue_sq *sq;
-    struct spinlock lck;
+    struct bce_queue_sq *sq; /* multi-producer */
+    struct spinlock lck; /* protects tres */
     struct bce_queue_cmdq_result_el **tres;
 };
 
@@ -127,8 +210,22 @@ struct bce_cmdq_register_memory_queue_cmd {
 static __always_inline void *bce_sq_element(struct bce_queue_sq *q, int i) {
     return (void *) ((u8 *) q->data + q->el_size * i);
 }
-static __always_inline void *bce_cq_element(struct bce_queue_cq *q, int i) {
-    return (void *) ((struct bce_qe_completion *) q->data + i);
+/* Typed accessors for the two fixed element sizes, so the common paths don't multiply by el_size */
+static __always_inline struct bce_qe_submission *bce_sq_submission(struct bce_queue_sq *q, u32 i) {
+    return (struct bce_qe_submission *) q->data + i;
+}
+static __always_inline void *bce_cmdq_element(struct bce_queue_sq *q, u32 i) {
+    return (void *) ((u8 *) q->data + BCE_CMD_SIZE * i);
+}
+static __always_inline struct bce_qe_completion *bce_cq_element(struct bce_queue_cq *q, u32 i) {
+    return (struct bce_qe_completion *) q->data + i;
+}
+
+/* Only valid for SQs created with bce_create_sq, whose elements are struct bce_qe_submission */
+static __always_inline struct bce_qe_submission *bce_next_submission(struct bce_queue_sq *sq) {
+    struct bce_qe_submission *ret = bce_sq_submission(sq, sq->tail);
+    sq->tail = (sq->tail + 1) & sq->el_mask;
+    return ret;
 }
 
 static __always_inline struct bce_sq_completion_data *bce_next_completion(struct bce_queue_sq *sq) {
@@ -137,26 +234,58 @@ static __always_inline struct bce_sq_completion_data *bce_next_completion(struct
     if (sq->completion_cidx == sq->completion_tail)
         return NULL;
     res = &sq->completion_data[sq->completion_cidx];
-    sq->completion_cidx = (sq->completion_cidx + 1) % sq->el_count;
+    sq->completion_cidx = (sq->completion_cidx + 1) & sq->el_mask;
     return res;
 }
 
+void bce_publish_queue(struct apple_bce_device *dev, struct bce_queue *q);
+void bce_unpublish_queue(struct apple_bce_device *dev, struct bce_queue *q);
+void bce_sync_queues(struct apple_bce_device *dev);
+
 struct bce_queue_cq *bce_alloc_cq(struct apple_bce_device *dev, int qid, u32 el_count);
 void bce_get_cq_memcfg(struct bce_queue_cq *cq, struct bce_queue_memcfg *cfg);
 void bce_free_cq(struct apple_bce_device *dev, struct bce_queue_cq *cq);
-void bce_handle_cq_completions(struct apple_bce_device *dev, struct bce_queue_cq *cq);
+bool bce_handle_cq_completions(struct apple_bce_device *dev, struct bce_queue_cq *cq);
+void bce_cq_set_budget(struct bce_queue_cq *cq, u32 budget, u32 doorbell_batch);
+void bce_cq_set_poll_interval(struct bce_queue_cq *cq, u32 interval_us);
+void bce_cq_poll_start(struct bce_queue_cq *cq);
+void bce_cq_poll_stop(struct bce_queue_cq *cq);
 
 struct bce_queue_sq *bce_alloc_sq(struct apple_bce_device *dev, int qid, u32 el_size, u32 el_count,
         bce_sq_completion compl, void *userdata);
 void bce_get_sq_memcfg(struct bce_queue_sq *sq, struct bce_queue_cq *cq, struct bce_queue_memcfg *cfg);
 void bce_free_sq(struct apple_bce_device *dev, struct bce_queue_sq *sq);
 int bce_reserve_submission(struct bce_queue_sq *sq, unsigned long *timeout);
+int bce_reserve_submission_pair(struct bce_queue_sq *a, struct bce_queue_sq *b, unsigned long *timeout);
 void bce_cancel_submission_reservation(struct bce_queue_sq *sq);
-void *bce_next_submission(struct bce_queue_sq *sq);
+/*
+ * Batched submission: reserve a number of elements at once, fill each of them with bce_next_submission and publish
+ * all of them with a single bce_submit_to_device, which costs one barrier and one doorbell write.
+ */
+int bce_reserve_submissions(struct bce_queue_sq *sq, u32 count, unsigned long *timeout);
+u32 bce_try_reserve_submissions(struct bce_queue_sq *sq, u32 max);
+void bce_cancel_submission_reservations(struct bce_queue_sq *sq, u32 count);
+/*
+ * Multi-producer submission: each producer reserves a credit, claims a slot with a ticket, fills the element and
+ * publishes the ticket without holding any lock. The doorbell only ever covers the filled prefix of the tickets.
+ */
+int bce_sq_enable_multi_producer(struct bce_queue_sq *sq);
+void bce_sq_enable_direct_completion(struct bce_queue_sq *sq, bce_sq_direct_completion compl);
+u32 bce_mp_claim_submission(struct bce_queue_sq *sq);
+void bce_mp_publish_submission(struct bce_queue_sq *sq, u32 ticket);
+static __always_inline u32 bce_mp_slot(struct bce_queue_sq *sq, u32 ticket) {
+    return ticket & sq->el_mask;
+}
+void bce_start_plug(struct apple_bce_device *dev, struct bce_sq_plug *plug);
+void bce_finish_plug(struct apple_bce_device *dev, struct bce_sq_plug *plug);
+void bce_flush_plug(struct apple_bce_device *dev);
 void bce_submit_to_device(struct bce_queue_sq *sq);
 void bce_notify_submission_complete(struct bce_queue_sq *sq);
 
 void bce_set_submission_single(struct bce_qe_submission *element, dma_addr_t addr, size_t size);
+#ifdef BCE_RING_BENCH
+u64 bce_sq_ring_bench(u32 iterations, u32 batch);
+#endif
 
 struct bce_queue_cmdq *bce_alloc_cmdq(struct apple_bce_device *dev, int qid, u32 el_count);
 void bce_free_cmdq(struct apple_bce_device *dev, struct bce_queue_cmdq *cmdq);
@@ -165,10 +294,25 @@ u32 bce_cmd_register_queue(struct bce_queue_cmdq *cmdq, struct bce_queue_memcfg
 u32 bce_cmd_unregister_memory_queue(struct bce_queue_cmdq *cmdq, u16 qid);
 u32 bce_cmd_flush_memory_queue(struct bce_queue_cmdq *cmdq, u16 qid);
 
+/*
+ * Async variants: res must stay valid until the command completes. With a callback, the callback is invoked on
+ * completion instead; without one, the result is collected with bce_cmd_wait. Several commands may be in flight.
+ */
+int bce_cmd_register_queue_async(struct bce_queue_cmdq *cmdq, struct bce_queue_memcfg *cfg, const char *name,
+        bool isdirout, struct bce_queue_cmdq_result_el *res, bce_cmd_callback cb, void *cb_data);
+int bce_cmd_unregister_memory_queue_async(struct bce_queue_cmdq *cmdq, u16 qid, struct bce_queue_cmdq_result_el *res,
+        bce_cmd_callback cb, void *cb_data);
+int bce_cmd_flush_memory_queue_async(struct bce_queue_cmdq *cmdq, u16 qid, struct bce_queue_cmdq_result_el *res,
+        bce_cmd_callback cb, void *cb_data);
+u32 bce_cmd_wait(struct bce_queue_cmdq *cmdq, struct bce_queue_cmdq_result_el *res, unsigned long timeout);
+
+
+void bce_queue_pool_init(struct apple_bce_device *dev);
+void bce_queue_pool_destroy(struct apple_bce_device *dev);
 
-/* User API - Creates and registers the queue */
+/* User API - Creates and registers the queue; a CQ from the queue pool may have more than el_count entries */
 
-struct bce_queue_cq *bce_create_cq(struct apple_bce_device *dev, u32 el_count);
+struct bce_queue_cq *bce_create_cq(struct apple_bce_device *dev, u32 el_count, enum bce_cq_vector_hint vector);
 struct bce_queue_sq *bce_create_sq(struct apple_bce_device *dev, struct bce_queue_cq *cq, const char *name, u32 el_count,
         int direction, bce_sq_completion compl, void *userdata);
 void bce_destroy_cq(struct apple_bce_device *dev, struct bce_queue_cq *cq);
@@ -1,16 +1,21 @@
 #include "queue_dma.h"
 #include <linux/vmalloc.h>
 #include <linux/mm.h>
+#include <linux/slab.h>
 #include "queue.h"
+#include "apple_bce.h"
 
 static int bce_alloc_scatterlist_from_vm(struct sg_table *tbl, void *data, size_t len);
 static struct bce_segment_list_element_hostinfo *bce_map_segment_list(
-        struct device *dev, struct scatterlist *pages, int pagen);
-static void bce_unmap_segement_list(struct device *dev, struct bce_segment_list_element_hostinfo *list);
+        struct apple_bce_device *bce, struct scatterlist *pages, int pagen, gfp_t gfp);
+static void bce_unmap_segement_list(struct apple_bce_device *bce, struct bce_segment_list_element_hostinfo *list);
+static size_t bce_segment_list_count(struct scatterlist *pages, int pagen);
 
-int bce_map_dma_buffer(struct device *dev, struct bce_dma_buffer *buf, struct sg_table scatterlist,
+int bce_map_dma_buffer(struct apple_bce_device *bce, struct bce_dma_buffer *buf, struct sg_table scatterlist,
         enum dma_data_direction dir)
 {
+    struct device *dev = &bce->pci->dev;
+    size_t n;
     int cnt;
 
     buf->direction = dir;
@@ -23,10 +28,16 @@ int bce_map_dma_buffer(struct device *dev, struct bce_dma_buffer *buf, struct sg
         dma_unmap_sg(dev, buf->scatterlist.sgl, buf->scatterlist.nents, dir);
         return -EIO;
     }
-    if (cnt == 1)
-        return 0;
+    n = bce_segment_list_count(buf->scatterlist.sgl, cnt);
+    if (n == 1)
+        return 0; /* contiguous, no segment list needed */
+    if (n > BCE_ELEMENTS_PER_PAGE) {
+        pr_err("bce: DMA buffer has too many segments: %zu\n", n);
+        dma_unmap_sg(dev, buf->scatterlist.sgl, buf->scatterlist.nents, dir);
+        return -E2BIG;
+    }
 
-    buf->seglist_hostinfo = bce_map_segment_list(dev, buf->scatterlist.sgl, buf->scatterlist.nents);
+    buf->seglist_hostinfo = bce_map_segment_list(bce, buf->scatterlist.sgl, buf->scatterlist.nents, GFP_KERNEL);
     if (!buf->seglist_hostinfo) {
         pr_err("bce: Creating segment list failed\n");
         dma_unmap_sg(dev, buf->scatterlist.sgl, buf->scatterlist.nents, dir);
@@ -35,21 +46,48 @@ int bce_map_dma_buffer(struct device *dev, struct bce_dma_buffer *buf, struct sg
     return 0;
 }
 
-int bce_map_dma_buffer_vm(struct device *dev, struct bce_dma_buffer *buf, void *data, size_t len,
+int bce_map_dma_buffer_premapped(struct apple_bce_device *bce, struct bce_dma_buffer *buf, struct scatterlist *sgl,
+        int nents, enum dma_data_direction dir, gfp_t gfp)
+{
+    size_t n;
+    buf->direction = dir;
+    buf->scatterlist.sgl = sgl;
+    buf->scatterlist.nents = buf->scatterlist.orig_nents = (unsigned int) nents;
+    buf->seglist_hostinfo = NULL;
+    n = bce_segment_list_count(sgl, nents);
+    if (n == 1)
+        return 0;
+    if (n > BCE_ELEMENTS_PER_PAGE)
+        return -E2BIG;
+    buf->seglist_hostinfo = bce_map_segment_list(bce, sgl, nents, gfp);
+    if (!buf->seglist_hostinfo) {
+        pr_err("bce: Creating segment list failed\n");
+        return -EIO;
+    }
+    return 0;
+}
+
+void bce_unmap_dma_buffer_premapped(struct apple_bce_device *bce, struct bce_dma_buffer *buf)
+{
+    bce_unmap_segement_list(bce, buf->seglist_hostinfo);
+    buf->seglist_hostinfo = NULL;
+}
+
+int bce_map_dma_buffer_vm(struct apple_bce_device *bce, struct bce_dma_buffer *buf, void *data, size_t len,
                           enum dma_data_direction dir)
 {
     int status;
     struct sg_table scatterlist;
     if ((status = bce_alloc_scatterlist_from_vm(&scatterlist, data, len)))
         return status;
-    if ((status = bce_map_dma_buffer(dev, buf, scatterlist, dir))) {
+    if ((status = bce_map_dma_buffer(bce, buf, scatterlist, dir))) {
         sg_free_table(&scatterlist);
         return status;
     }
     return 0;
 }
 
-int bce_map_dma_buffer_km(struct device *dev, struct bce_dma_buffer *buf, void *data, size_t len,
+int bce_map_dma_buffer_km(struct apple_bce_device *bce, struct bce_dma_buffer *buf, void *data, size_t len,
                           enum dma_data_direction dir)
 {
     /* Kernel memory is continuous which is great for us. */
@@ -60,20 +98,20 @@ int bce_map_dma_buffer_km(struct device *dev, struct bce_dma_buffer *buf, void *
         return status;
     }
     sg_set_buf(scatterlist.sgl, data, (uint) len);
-    if ((status = bce_map_dma_buffer(dev, buf, scatterlist, dir))) {
+    if ((status = bce_map_dma_buffer(bce, buf, scatterlist, dir))) {
         sg_free_table(&scatterlist);
         return status;
     }
     return 0;
 }
 
-void bce_unmap_dma_buffer(struct device *dev, struct bce_dma_buffer *buf)
+void bce_unmap_dma_buffer(struct apple_bce_device *bce, struct bce_dma_buffer *buf)
 {
-    dma_unmap_sg(dev, buf->scatterlist.sgl, buf->scatterlist.nents, buf->direction);
-    bce_unmap_segement_list(dev, buf->seglist_hostinfo);
+    dma_unmap_sg(&bce->pci->dev, buf->scatterlist.sgl, buf->scatterlist.nents, buf->direction);
+    bce_unmap_segement_list(bce, buf->seglist_hostinfo);
+    sg_free_table(&buf->scatterlist);
 }
 
-
 static int bce_alloc_scatterlist_from_vm(struct sg_table *tbl, void *data, size_t len)
 {
     int status, i;
@@ -103,90 +141,154 @@ static int bce_alloc_scatterlist_from_vm(struct sg_table *tbl, void *data, size_
     return status;
 }
 
-#define BCE_ELEMENTS_PER_PAGE ((PAGE_SIZE - sizeof(struct bce_segment_list_header)) \
-                               / sizeof(struct bce_segment_list_element))
-#define BCE_ELEMENTS_PER_ADDITIONAL_PAGE (PAGE_SIZE / sizeof(struct bce_segment_list_element))
+static struct bce_segment_list_element_hostinfo *bce_segl_page_alloc(struct bce_segl_pool *pool, gfp_t gfp)
+{
+    struct bce_segment_list_element_hostinfo *seg;
+    seg = kmem_cache_alloc(pool->hostinfo_cache, gfp);
+    if (!seg)
+        return NULL;
+    seg->next = NULL;
+    seg->length = PAGE_SIZE;
+    seg->page_start = (void *) __get_free_page(gfp);
+    if (!seg->page_start)
+        goto fail;
+    seg->dma_start = dma_map_single(pool->dev, seg->page_start, PAGE_SIZE, DMA_TO_DEVICE);
+    if (dma_mapping_error(pool->dev, seg->dma_start))
+        goto fail_page;
+    return seg;
 
-static struct bce_segment_list_element_hostinfo *bce_map_segment_list(
-        struct device *dev, struct scatterlist *pages, int pagen)
+fail_page:
+    free_page((unsigned long) seg->page_start);
+fail:
+    kmem_cache_free(pool->hostinfo_cache, seg);
+    return NULL;
+}
+
+static void bce_segl_page_free(struct bce_segl_pool *pool, struct bce_segment_list_element_hostinfo *seg)
+{
+    dma_unmap_single(pool->dev, seg->dma_start, PAGE_SIZE, DMA_TO_DEVICE);
+    free_page((unsigned long) seg->page_start);
+    kmem_cache_free(pool->hostinfo_cache, seg);
+}
+
+int bce_segl_pool_init(struct bce_segl_pool *pool, struct device *dev)
+{
+    struct bce_segment_list_element_hostinfo *seg;
+    pool->dev = dev;
+    spin_lock_init(&pool->lock);
+    pool->free = NULL;
+    pool->free_count = 0;
+    pool->hostinfo_cache = kmem_cache_create("bce_segl_hostinfo", sizeof(struct bce_segment_list_element_hostinfo),
+            0, 0, NULL);
+    if (!pool->hostinfo_cache)
+        return -ENOMEM;
+    while (pool->free_count < BCE_SEGL_POOL_PREFILL && (seg = bce_segl_page_alloc(pool, GFP_KERNEL))) {
+        seg->next = pool->free;
+        pool->free = seg;
+        ++pool->free_count;
+    }
+    return 0;
+}
+
+void bce_segl_pool_destroy(struct bce_segl_pool *pool)
+{
+    struct bce_segment_list_element_hostinfo *seg;
+    while ((seg = pool->free)) {
+        pool->free = seg->next;
+        bce_segl_page_free(pool, seg);
+    }
+    pool->free_count = 0;
+    kmem_cache_destroy(pool->hostinfo_cache);
+}
+
+static struct bce_segment_list_element_hostinfo *bce_segl_page_get(struct bce_segl_pool *pool, gfp_t gfp)
+{
+    unsigned long flags;
+    struct bce_segment_list_element_hostinfo *seg;
+    spin_lock_irqsave(&pool->lock, flags);
+    seg = pool->free;
+    if (seg) {
+        pool->free = seg->next;
+        --pool->free_count;
+        ++pool->stat_hits;
+    } else {
+        ++pool->stat_misses;
+    }
+    spin_unlock_irqrestore(&pool->lock, flags);
+    if (!seg)
+        return bce_segl_page_alloc(pool, gfp);
+    seg->next = NULL;
+    return seg;
+}
+
+static void bce_segl_page_put(struct bce_segl_pool *pool, struct bce_segment_list_element_hostinfo *seg)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&pool->lock, flags);
+    if (pool->free_count < BCE_SEGL_POOL_MAX) {
+        seg->next = pool->free;
+        pool->free = seg;
+        ++pool->free_count;
+        seg = NULL;
+    }
+    spin_unlock_irqrestore(&pool->lock, flags);
+    if (seg)
+        bce_segl_page_free(pool, seg);
+}
+
+/* The number of elements once physically contiguous entries are merged */
+static size_t bce_segment_list_count(struct scatterlist *pages, int pagen)
 {
-    size_t ptr, pptr = 0;
-    struct bce_segment_list_header theader; /* a temp header, to store the initial seg */
-    struct bce_segment_list_header *header;
-    struct bce_segment_list_element *el, *el_end;
-    struct bce_segment_list_element_hostinfo *out, *pout, *out_root;
     struct scatterlist *sg;
+    dma_addr_t end = DMA_MAPPING_ERROR;
+    size_t n = 0;
     int i;
-    header = &theader;
-    out = out_root = NULL;
-    el = el_end = NULL;
     for_each_sg(pages, sg, pagen, i) {
-        if (el >= el_end) {
-            /* allocate a new page, this will be also done for the first element */
-            ptr = __get_free_page(GFP_KERNEL);
-            if (pptr && ptr == pptr + PAGE_SIZE) {
-                out->page_count++;
-                header->element_count += BCE_ELEMENTS_PER_ADDITIONAL_PAGE;
-                el_end += BCE_ELEMENTS_PER_ADDITIONAL_PAGE;
-            } else {
-                header = (void *) ptr;
-                header->element_count = BCE_ELEMENTS_PER_PAGE;
-                header->data_size = 0;
-                header->next_segl_addr = 0;
-                header->next_segl_length = 0;
-                el = (void *) (header + 1);
-                el_end = el + BCE_ELEMENTS_PER_PAGE;
-
-                if (out) {
-                    out->next = kmalloc(sizeof(struct bce_segment_list_element_hostinfo), GFP_KERNEL);
-                    out = out->next;
-                } else {
-                    out_root = out = kmalloc(sizeof(struct bce_segment_list_element_hostinfo), GFP_KERNEL);
-                }
-                out->page_start = (void *) ptr;
-                out->page_count = 1;
-                out->dma_start = DMA_MAPPING_ERROR;
-                out->next = NULL;
-            }
-            pptr = ptr;
-        }
-        el->addr = sg->dma_address;
-        el->length = sg->length;
-        header->data_size += el->length;
+        if (sg_dma_address(sg) != end)
+            ++n;
+        end = sg_dma_address(sg) + sg_dma_len(sg);
     }
+    return n;
+}
+
+/* The callers make sure the merged list fits in one page */
+static struct bce_segment_list_element_hostinfo *bce_map_segment_list(
+        struct apple_bce_device *bce, struct scatterlist *pages, int pagen, gfp_t gfp)
+{
+    struct bce_segment_list_header *header;
+    struct bce_segment_list_element *el, *prev = NULL;
+    struct bce_segment_list_element_hostinfo *out;
+    struct scatterlist *sg;
+    int i;
+    out = bce_segl_page_get(&bce->segl_pool, gfp);
+    if (!out)
+        return NULL;
 
-    /* DMA map */
-    out = out_root;
-    pout = NULL;
-    while (out) {
-        out->dma_start = dma_map_single(dev, out->page_start, out->page_count * PAGE_SIZE, DMA_TO_DEVICE);
-        if (dma_mapping_error(dev, out->dma_start))
-            goto error;
-        if (pout) {
-            header = pout->page_start;
-            header->next_segl_addr = out->dma_start;
-            header->next_segl_length = out->page_count * PAGE_SIZE;
+    header = out->page_start;
+    header->element_count = 0;
+    header->data_size = 0;
+    header->next_segl_addr = 0;
+    header->next_segl_length = 0;
+    el = (void *) (header + 1);
+    for_each_sg(pages, sg, pagen, i) {
+        if (prev && prev->addr + prev->length == sg_dma_address(sg)) {
+            prev->length += sg_dma_len(sg);
+        } else {
+            el->addr = sg_dma_address(sg);
+            el->length = sg_dma_len(sg);
+            prev = el++;
+            ++header->element_count;
         }
-        pout = out;
-        out = out->next;
+        header->data_size += sg_dma_len(sg);
     }
-    return out_root;
-
-    error:
-    bce_unmap_segement_list(dev, out_root);
-    return NULL;
+    dma_sync_single_for_device(&bce->pci->dev, out->dma_start, out->length, DMA_TO_DEVICE);
+    return out;
 }
 
-static void bce_unmap_segement_list(struct device *dev, struct bce_segment_list_element_hostinfo *list)
+static void bce_unmap_segement_list(struct apple_bce_device *bce, struct bce_segment_list_element_hostinfo *list)
 {
-    struct bce_segment_list_element_hostinfo *next;
-    while (list) {
-        if (list->dma_start != DMA_MAPPING_ERROR)
-            dma_unmap_single(dev, list->dma_start, list->page_count * PAGE_SIZE, DMA_TO_DEVICE);
-        next = list->next;
-        kfree(list);
-        list = next;
-    }
+    if (list)
+        bce_segl_page_put(&bce->segl_pool, list);
 }
 
 int bce_set_submission_buf(struct bce_qe_submission *element, struct bce_dma_buffer *buf, size_t offset, size_t length)
@@ -203,18 +305,12 @@ int bce_set_submission_buf(struct bce_qe_submission *element, struct bce_dma_buf
         return 0;
     }
 
-    while (seg) {
-        seg_header = seg->page_start;
-        if (offset <= seg_header->data_size)
-            break;
-        offset -= seg_header->data_size;
-        seg = seg->next;
-    }
-    if (!seg)
+    seg_header = seg->page_start;
+    if (offset > seg_header->data_size)
         return -EINVAL;
     element->addr = offset;
-    element->length = buf->scatterlist.sgl->dma_length;
+    element->length = length;
     element->segl_addr = seg->dma_start;
-    element->segl_length = seg->page_count * PAGE_SIZE;
+    element->segl_length = seg->length;
     return 0;
-}
\ No newline at end of file
+}
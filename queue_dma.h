@@ -2,8 +2,10 @@
 #define BCE_QUEUE_DMA_H
 
 #include <linux/pci.h>
+#include <linux/spinlock.h>
 
 struct bce_qe_submission;
+struct apple_bce_device;
 
 struct bce_segment_list_header {
     u64 element_count;
@@ -17,13 +19,36 @@ struct bce_segment_list_element {
     u64 length;
 };
 
+#define BCE_ELEMENTS_PER_PAGE ((PAGE_SIZE - sizeof(struct bce_segment_list_header)) \
+                               / sizeof(struct bce_segment_list_element))
+
+/* A segment list is always a single pooled page, so at most BCE_ELEMENTS_PER_PAGE merged entries */
 struct bce_segment_list_element_hostinfo {
-    struct bce_segment_list_element_hostinfo *next;
+    struct bce_segment_list_element_hostinfo *next; /* pool free list */
     void *page_start;
-    size_t page_count;
+    size_t length;
     dma_addr_t dma_start;
 };
 
+/*
+ * Recycled segment list pages, each one already mapped for the device, and a slab for their hostinfo nodes, so that
+ * mapping a scatter-gather buffer does not hit the page allocator or create new streaming mappings.
+ */
+#define BCE_SEGL_POOL_PREFILL 16
+#define BCE_SEGL_POOL_MAX 128
+struct bce_segl_pool {
+    struct device *dev;
+    struct kmem_cache *hostinfo_cache;
+    spinlock_t lock;
+    struct bce_segment_list_element_hostinfo *free; /* linked through next */
+    u32 free_count;
+    u64 stat_hits;
+    u64 stat_misses;
+};
+
+int bce_segl_pool_init(struct bce_segl_pool *pool, struct device *dev);
+void bce_segl_pool_destroy(struct bce_segl_pool *pool);
+
 
 struct bce_dma_buffer {
     enum dma_data_direction direction;
@@ -32,18 +57,31 @@ struct bce_dma_buffer {
 };
 
 /* NOTE: Takes ownership of the sg_table if it succeeds. Ownership is not transferred on failure. */
-int bce_map_dma_buffer(struct device *dev, struct bce_dma_buffer *buf, struct sg_table scatterlist,
+int bce_map_dma_buffer(struct apple_bce_device *bce, struct bce_dma_buffer *buf, struct sg_table scatterlist,
         enum dma_data_direction dir);
 
+/*
+ * For a scatterlist that is already DMA mapped, e.g. by the USB core; only the segment list is built. Both calls are
+ * usable under a spinlock.
+ */
+int bce_map_dma_buffer_premapped(struct apple_bce_device *bce, struct bce_dma_buffer *buf, struct scatterlist *sgl,
+        int nents, enum dma_data_direction dir, gfp_t gfp);
+void bce_unmap_dma_buffer_premapped(struct apple_bce_device *bce, struct bce_dma_buffer *buf);
+
+/*
+ * These map on every call. Long-lived buffers (the rings, the aaudio data, the VHCI interrupt rings) are coherent
+ * allocations from bce_dma_alloc instead, which need neither a remap nor syncs per transfer.
+ */
+
 /* Creates a buffer from virtual memory (vmalloc) */
-int bce_map_dma_buffer_vm(struct device *dev, struct bce_dma_buffer *buf, void *data, size_t len,
+int bce_map_dma_buffer_vm(struct apple_bce_device *bce, struct bce_dma_buffer *buf, void *data, size_t len,
         enum dma_data_direction dir);
 
 /* Creates a buffer from kernel memory (kmalloc) */
-int bce_map_dma_buffer_km(struct device *dev, struct bce_dma_buffer *buf, void *data, size_t len,
+int bce_map_dma_buffer_km(struct apple_bce_device *bce, struct bce_dma_buffer *buf, void *data, size_t len,
                           enum dma_data_direction dir);
 
-void bce_unmap_dma_buffer(struct device *dev, struct bce_dma_buffer *buf);
+void bce_unmap_dma_buffer(struct apple_bce_device *bce, struct bce_dma_buffer *buf);
 
 int bce_set_submission_buf(struct bce_qe_submission *element, struct bce_dma_buffer *buf, size_t offset, size_t length);
 
@@ -8,7 +8,7 @@ static void bce_vhci_message_queue_completion(struct bce_queue_sq *sq);
 int bce_vhci_message_queue_create(struct bce_vhci *vhci, struct bce_vhci_message_queue *ret, const char *name)
 {
     int status;
-    ret->cq = bce_create_cq(vhci->dev, VHCI_EVENT_QUEUE_EL_COUNT);
+    ret->cq = bce_create_cq(vhci->dev, VHCI_EVENT_QUEUE_EL_COUNT, BCE_CQ_VECTOR_DEFAULT);
     if (!ret->cq)
         return -EINVAL;
     ret->sq = bce_create_sq(vhci->dev, ret->cq, name, VHCI_EVENT_QUEUE_EL_COUNT, DMA_TO_DEVICE,
@@ -17,8 +17,11 @@ int bce_vhci_message_queue_create(struct bce_vhci *vhci, struct bce_vhci_message
         status = -EINVAL;
         goto fail_cq;
     }
-    ret->data = dma_alloc_coherent(&vhci->dev->pci->dev, sizeof(struct bce_vhci_message) * VHCI_EVENT_QUEUE_EL_COUNT,
-                                   &ret->dma_addr, GFP_KERNEL);
+    /* Messages are written from any endpoint's context without a lock */
+    if ((status = bce_sq_enable_multi_producer(ret->sq)))
+        goto fail_sq;
+    ret->data = bce_dma_alloc(vhci->dev, BCE_DMA_VHCI, sizeof(struct bce_vhci_message) * VHCI_EVENT_QUEUE_EL_COUNT,
+                              &ret->dma_addr);
     if (!ret->data) {
         status = -EINVAL;
         goto fail_sq;
@@ -38,23 +41,24 @@ void bce_vhci_message_queue_destroy(struct bce_vhci *vhci, struct bce_vhci_messa
 {
     if (!q->cq)
         return;
-    dma_free_coherent(&vhci->dev->pci->dev, sizeof(struct bce_vhci_message) * VHCI_EVENT_QUEUE_EL_COUNT,
-                      q->data, q->dma_addr);
+    bce_dma_free(vhci->dev, BCE_DMA_VHCI, sizeof(struct bce_vhci_message) * VHCI_EVENT_QUEUE_EL_COUNT,
+                 q->data, q->dma_addr);
     bce_destroy_sq(vhci->dev, q->sq);
     bce_destroy_cq(vhci->dev, q->cq);
 }
 
 void bce_vhci_message_queue_write(struct bce_vhci_message_queue *q, struct bce_vhci_message *req)
 {
-    int sidx;
+    u32 ticket, sidx;
     struct bce_qe_submission *s;
-    sidx = q->sq->tail;
-    s = bce_next_submission(q->sq);
+    ticket = bce_mp_claim_submission(q->sq);
+    sidx = bce_mp_slot(q->sq, ticket);
+    s = bce_sq_submission(q->sq, sidx);
     pr_debug("bce-vhci: Send message: %x s=%x p1=%x p2=%llx\n", req->cmd, req->status, req->param1, req->param2);
     q->data[sidx] = *req;
     bce_set_submission_single(s,q->dma_addr + sizeof(struct bce_vhci_message) * sidx,
             sizeof(struct bce_vhci_message));
-    bce_submit_to_device(q->sq);
+    bce_mp_publish_submission(q->sq, ticket);
 }
 
 static void bce_vhci_message_queue_completion(struct bce_queue_sq *sq)
@@ -75,8 +79,8 @@ int __bce_vhci_event_queue_create(struct bce_vhci *vhci, struct bce_vhci_event_q
     ret->sq = bce_create_sq(vhci->dev, vhci->ev_cq, name, VHCI_EVENT_QUEUE_EL_COUNT, DMA_FROM_DEVICE, compl, ret);
     if (!ret->sq)
         return -EINVAL;
-    ret->data = dma_alloc_coherent(&vhci->dev->pci->dev, sizeof(struct bce_vhci_message) * VHCI_EVENT_QUEUE_EL_COUNT,
-                                   &ret->dma_addr, GFP_KERNEL);
+    ret->data = bce_dma_alloc(vhci->dev, BCE_DMA_VHCI, sizeof(struct bce_vhci_message) * VHCI_EVENT_QUEUE_EL_COUNT,
+                              &ret->dma_addr);
     if (!ret->data) {
         bce_destroy_sq(vhci->dev, ret->sq);
         ret->sq = NULL;
@@ -98,8 +102,8 @@ void bce_vhci_event_queue_destroy(struct bce_vhci *vhci, struct bce_vhci_event_q
 {
     if (!q->sq)
         return;
-    dma_free_coherent(&vhci->dev->pci->dev, sizeof(struct bce_vhci_message) * VHCI_EVENT_QUEUE_EL_COUNT,
-                      q->data, q->dma_addr);
+    bce_dma_free(vhci->dev, BCE_DMA_VHCI, sizeof(struct bce_vhci_message) * VHCI_EVENT_QUEUE_EL_COUNT,
+                 q->data, q->dma_addr);
     bce_destroy_sq(vhci->dev, q->sq);
 }
 
@@ -123,12 +127,12 @@ static void bce_vhci_event_queue_completion(struct bce_queue_sq *sq)
 void bce_vhci_event_queue_submit_pending(struct bce_vhci_event_queue *q, size_t count)
 {
     int idx;
+    size_t reserved;
     struct bce_qe_submission *s;
-    while (count--) {
-        if (bce_reserve_submission(q->sq, NULL)) {
-            pr_err("bce-vhci: Failed to reserve an event queue submission\n");
-            break;
-        }
+    reserved = bce_try_reserve_submissions(q->sq, (u32) count);
+    if (reserved < count)
+        pr_err("bce-vhci: Failed to reserve an event queue submission\n");
+    while (reserved--) {
         idx = q->sq->tail;
         s = bce_next_submission(q->sq);
         bce_set_submission_single(s,
@@ -138,107 +142,290 @@ void bce_vhci_event_queue_submit_pending(struct bce_vhci_event_queue *q, size_t
 }
 
 
+/* How long the firmware gets to acknowledge the cancellation of a command that timed out */
+#define BCE_VHCI_CMD_CANCEL_TIMEOUT 1000
+
+static void bce_vhci_command_timeout_w(struct work_struct *work);
+
 void bce_vhci_command_queue_create(struct bce_vhci_command_queue *ret, struct bce_vhci_message_queue *mq)
 {
+    int i;
+    struct bce_vhci_pending_command *c;
     ret->mq = mq;
-    ret->completion.result = NULL;
-    init_completion(&ret->completion.completion);
-    spin_lock_init(&ret->completion_lock);
-    mutex_init(&ret->mutex);
+    spin_lock_init(&ret->lock);
+    init_waitqueue_head(&ret->slot_wq);
+    ret->next_seq = 0;
+    ret->destroyed = false;
+    for (i = 0; i < BCE_VHCI_CMD_MAX_PENDING; i++) {
+        c = &ret->cmds[i];
+        c->cq = ret;
+        c->in_use = false;
+        init_completion(&c->completion);
+        INIT_DELAYED_WORK(&c->w_timeout, bce_vhci_command_timeout_w);
+    }
 }
 
-void bce_vhci_command_queue_destroy(struct bce_vhci_command_queue *cq)
+static bool bce_vhci_command_queue_idle(struct bce_vhci_command_queue *cq)
 {
-    spin_lock(&cq->completion_lock);
-    if (cq->completion.result) {
-        memset(cq->completion.result, 0, sizeof(struct bce_vhci_message));
-        cq->completion.result->status = BCE_VHCI_ABORT;
-        complete(&cq->completion.completion);
-        cq->completion.result = NULL;
-    }
-    spin_unlock(&cq->completion_lock);
-    mutex_lock(&cq->mutex);
-    mutex_unlock(&cq->mutex);
-    mutex_destroy(&cq->mutex);
+    int i;
+    unsigned long flags;
+    bool idle = true;
+    spin_lock_irqsave(&cq->lock, flags);
+    for (i = 0; i < BCE_VHCI_CMD_MAX_PENDING; i++)
+        idle &= !cq->cmds[i].in_use;
+    spin_unlock_irqrestore(&cq->lock, flags);
+    return idle;
 }
 
-void bce_vhci_command_queue_deliver_completion(struct bce_vhci_command_queue *cq, struct bce_vhci_message *msg)
+static void bce_vhci_command_release(struct bce_vhci_pending_command *c)
 {
-    struct bce_vhci_command_queue_completion *c = &cq->completion;
+    unsigned long flags;
+    spin_lock_irqsave(&c->cq->lock, flags);
+    c->in_use = false;
+    spin_unlock_irqrestore(&c->cq->lock, flags);
+    wake_up_all(&c->cq->slot_wq);
+}
 
-    spin_lock(&cq->completion_lock);
-    if (c->result) {
-        *c->result = *msg;
+/* Only called by whoever flipped c->done; synchronous waiters release the slot themselves */
+static void bce_vhci_command_finish(struct bce_vhci_pending_command *c, int status)
+{
+    c->status = status;
+    if (c->cb) {
+        c->cb(c->cq, &c->res, status, c->ctx);
+        bce_vhci_command_release(c);
+    } else {
         complete(&c->completion);
-        c->result = NULL;
     }
-    spin_unlock(&cq->completion_lock);
 }
 
-static int bce_vhci_command_queue_cancel(struct bce_vhci_command_queue *cq, struct bce_vhci_message *req,
-        struct bce_vhci_message *res);
+void bce_vhci_command_queue_destroy(struct bce_vhci_command_queue *cq)
+{
+    int i;
+    bool abort;
+    unsigned long flags;
+    struct bce_vhci_pending_command *c;
+    if (!cq->mq)
+        return;
+    spin_lock_irqsave(&cq->lock, flags);
+    cq->destroyed = true;
+    spin_unlock_irqrestore(&cq->lock, flags);
+    wake_up_all(&cq->slot_wq);
+
+    for (i = 0; i < BCE_VHCI_CMD_MAX_PENDING; i++) {
+        c = &cq->cmds[i];
+        cancel_delayed_work_sync(&c->w_timeout);
+        spin_lock_irqsave(&cq->lock, flags);
+        abort = c->in_use && !c->done;
+        if (abort) {
+            c->done = true;
+            memset(&c->res, 0, sizeof(struct bce_vhci_message));
+            c->res.status = BCE_VHCI_ABORT;
+        }
+        spin_unlock_irqrestore(&cq->lock, flags);
+        if (abort)
+            bce_vhci_command_finish(c, BCE_VHCI_ABORT);
+    }
+    wait_event(cq->slot_wq, bce_vhci_command_queue_idle(cq));
+    for (i = 0; i < BCE_VHCI_CMD_MAX_PENDING; i++)
+        cancel_delayed_work_sync(&cq->cmds[i].w_timeout);
+    cq->mq = NULL;
+}
+
+static bool bce_vhci_command_matches(struct bce_vhci_pending_command *c, struct bce_vhci_message *msg)
+{
+    if (!c->in_use || c->done)
+        return false;
+    if ((msg->cmd & ~0xC000) != (c->req.cmd & ~0x4000))
+        return false;
+    return !(msg->cmd & 0x4000) || c->cancelling;
+}
 
-int __bce_vhci_command_queue_execute(struct bce_vhci_command_queue *cq, struct bce_vhci_message *req,
-        struct bce_vhci_message *res, unsigned long timeout)
+/* The firmware doesn't echo param1 for every command, so replies go by the code alone, see bce_vhci_command_claim */
+void bce_vhci_command_queue_deliver_completion(struct bce_vhci_command_queue *cq, struct bce_vhci_message *msg)
 {
+    int i;
     int status;
-    struct bce_vhci_command_queue_completion *c;
-    c = &cq->completion;
+    unsigned long flags;
+    struct bce_vhci_pending_command *c = NULL;
 
-    if ((status = bce_reserve_submission(cq->mq->sq, &timeout)))
+    spin_lock_irqsave(&cq->lock, flags);
+    for (i = 0; i < BCE_VHCI_CMD_MAX_PENDING && !c; i++) {
+        if (bce_vhci_command_matches(&cq->cmds[i], msg))
+            c = &cq->cmds[i];
+    }
+    if (!c) {
+        spin_unlock_irqrestore(&cq->lock, flags);
+        pr_debug("bce-vhci: Dropping command reply nobody waits for: %x s=%x p1=%x p2=%llx\n",
+                msg->cmd, msg->status, msg->param1, msg->param2);
+        return;
+    }
+    c->done = true;
+    c->res = *msg;
+    spin_unlock_irqrestore(&cq->lock, flags);
+    cancel_delayed_work(&c->w_timeout);
+
+    if (c->cancelling && (msg->cmd & 0x4000))
+        status = -ETIMEDOUT; /* the firmware acknowledged the abort */
+    else if (msg->status == BCE_VHCI_SUCCESS)
+        status = 0;
+    else
+        status = msg->status;
+    bce_vhci_command_finish(c, status);
+}
+
+static int bce_vhci_command_queue_send(struct bce_vhci_command_queue *cq, struct bce_vhci_message *req,
+        unsigned long *timeout)
+{
+    int status;
+    if ((status = bce_reserve_submission(cq->mq->sq, timeout)))
         return status;
+    bce_vhci_message_queue_write(cq->mq, req);
+    bce_flush_plug(cq->mq->sq->dev);
+    return 0;
+}
 
-    spin_lock(&cq->completion_lock);
-    c->result = res;
-    reinit_completion(&c->completion);
-    spin_unlock(&cq->completion_lock);
+/*
+ * A command that timed out is cancelled first; if the cancellation isn't answered either, it fails with -ETIMEDOUT
+ * and any late reply is dropped.
+ */
+static void bce_vhci_command_timeout_w(struct work_struct *work)
+{
+    unsigned long flags;
+    unsigned long timeout = BCE_VHCI_CMD_CANCEL_TIMEOUT;
+    struct bce_vhci_message creq;
+    struct bce_vhci_pending_command *c = container_of(to_delayed_work(work), struct bce_vhci_pending_command, w_timeout);
+    struct bce_vhci_command_queue *cq = c->cq;
 
-    bce_vhci_message_queue_write(cq->mq, req);
+    spin_lock_irqsave(&cq->lock, flags);
+    /* The reply's cancel_delayed_work doesn't wait for us, the slot may have been released and claimed again since */
+    if (!c->in_use || c->done || c->timeout_seq != c->seq || delayed_work_pending(&c->w_timeout)) {
+        spin_unlock_irqrestore(&cq->lock, flags);
+        return;
+    }
+    if (c->cancelling || (c->req.cmd & 0x4000)) {
+        c->done = true;
+        spin_unlock_irqrestore(&cq->lock, flags);
+        if (c->cancelling)
+            pr_err("bce-vhci: Possible desync, cancel timeout\n");
+        bce_vhci_command_finish(c, -ETIMEDOUT);
+        return;
+    }
+    c->cancelling = true;
+    creq = c->req;
+    creq.cmd |= 0x4000;
+    spin_unlock_irqrestore(&cq->lock, flags);
 
-    if (!wait_for_completion_timeout(&c->completion, timeout)) {
-        /* we ran out of time, clean up info */
-        spin_lock(&cq->completion_lock);
-        c->result = NULL;
-        spin_unlock(&cq->completion_lock);
+    /* Without a way to send the cancellation, just wait for it as if it got lost */
+    if (bce_vhci_command_queue_send(cq, &creq, &timeout))
+        pr_err("bce-vhci: Failed to send a command cancellation\n");
 
-        if (!(req->cmd & 0x4000))
-            return bce_vhci_command_queue_cancel(cq, req, res);
+    spin_lock_irqsave(&cq->lock, flags);
+    if (!c->done)
+        queue_delayed_work(system_wq, &c->w_timeout, BCE_VHCI_CMD_CANCEL_TIMEOUT);
+    spin_unlock_irqrestore(&cq->lock, flags);
+}
 
-        return -ETIMEDOUT;
+/*
+ * Only one command per code is outstanding at a time, so that a reply without param1 can't be given to the wrong one;
+ * commands with different codes still run side by side.
+ */
+static struct bce_vhci_pending_command *bce_vhci_command_claim(struct bce_vhci_command_queue *cq,
+        struct bce_vhci_message *req, bce_vhci_command_callback cb, void *ctx)
+{
+    int i;
+    unsigned long flags;
+    struct bce_vhci_pending_command *c, *ret = NULL;
+
+    spin_lock_irqsave(&cq->lock, flags);
+    if (cq->destroyed) {
+        spin_unlock_irqrestore(&cq->lock, flags);
+        return ERR_PTR(-ENODEV);
     }
-
-    if ((res->cmd & ~0xC000) != (req->cmd & ~0x4000)) {
-        pr_err("bce-vhci: Possible desync, cmd reply mismatch req=%x, res=%x\n", req->cmd, res->cmd);
-        return -EIO;
+    for (i = 0; i < BCE_VHCI_CMD_MAX_PENDING; i++) {
+        c = &cq->cmds[i];
+        if (!c->in_use) {
+            if (!ret)
+                ret = c;
+        } else if ((c->req.cmd & ~0x4000) == (req->cmd & ~0x4000)) {
+            spin_unlock_irqrestore(&cq->lock, flags);
+            return NULL;
+        }
     }
-    if (res->status == BCE_VHCI_SUCCESS)
-        return 0;
-    return res->status;
+    if (ret) {
+        ret->in_use = true;
+        ret->done = false;
+        ret->cancelling = false;
+        ret->req = *req;
+        memset(&ret->res, 0, sizeof(struct bce_vhci_message));
+        ret->seq = cq->next_seq++;
+        ret->cb = cb;
+        ret->ctx = ctx;
+        reinit_completion(&ret->completion);
+    }
+    spin_unlock_irqrestore(&cq->lock, flags);
+    return ret;
 }
 
-static int bce_vhci_command_queue_cancel(struct bce_vhci_command_queue *cq, struct bce_vhci_message *req,
-        struct bce_vhci_message *res)
+static struct bce_vhci_pending_command *__bce_vhci_command_queue_submit(struct bce_vhci_command_queue *cq,
+        struct bce_vhci_message *req, unsigned long timeout, bce_vhci_command_callback cb, void *ctx)
 {
     int status;
-    struct bce_vhci_message creq;
-    creq = *req;
-    creq.cmd |= 0x4000;
-    status = __bce_vhci_command_queue_execute(cq, &creq, res, 1000);
-    if (status == -ETIMEDOUT) {
-        pr_err("bce-vhci: Possible desync, cancel timeout\n");
-        return -ETIMEDOUT;
+    u64 seq;
+    unsigned long flags;
+    struct bce_vhci_pending_command *c;
+    DEFINE_WAIT(wait);
+
+    /* Claiming takes the slot, so it's done once per wakeup rather than as a wait_event condition */
+    for (;;) {
+        prepare_to_wait(&cq->slot_wq, &wait, TASK_UNINTERRUPTIBLE);
+        if ((c = bce_vhci_command_claim(cq, req, cb, ctx)))
+            break;
+        schedule();
     }
-    if (!(res->cmd & 0x4000)) /* The abort did not get through probably */
-        return status;
-    return -ETIMEDOUT;
+    finish_wait(&cq->slot_wq, &wait);
+    if (IS_ERR(c))
+        return c;
+    seq = c->seq;
+
+    if ((status = bce_vhci_command_queue_send(cq, req, &timeout))) {
+        bce_vhci_command_release(c);
+        return ERR_PTR(status);
+    }
+
+    /* The reply may have already arrived, and an async slot may even have been reused since */
+    spin_lock_irqsave(&cq->lock, flags);
+    if (c->in_use && c->seq == seq && !c->done) {
+        c->timeout_seq = seq;
+        queue_delayed_work(system_wq, &c->w_timeout, timeout);
+    }
+    spin_unlock_irqrestore(&cq->lock, flags);
+    return c;
+}
+
+/*
+ * Sends a command without waiting for its reply; cb gets the result. May sleep while all the command slots are busy
+ * or another command with the same code is still outstanding.
+ */
+int bce_vhci_command_queue_submit(struct bce_vhci_command_queue *cq, struct bce_vhci_message *req,
+        unsigned long timeout, bce_vhci_command_callback cb, void *ctx)
+{
+    struct bce_vhci_pending_command *c = __bce_vhci_command_queue_submit(cq, req, timeout, cb, ctx);
+    return IS_ERR(c) ? (int) PTR_ERR(c) : 0;
 }
 
 int bce_vhci_command_queue_execute(struct bce_vhci_command_queue *cq, struct bce_vhci_message *req,
                                    struct bce_vhci_message *res, unsigned long timeout)
 {
     int status;
-    mutex_lock(&cq->mutex);
-    status = __bce_vhci_command_queue_execute(cq, req, res, timeout);
-    mutex_unlock(&cq->mutex);
+    struct bce_vhci_pending_command *c;
+    c = __bce_vhci_command_queue_submit(cq, req, timeout, NULL, NULL);
+    if (IS_ERR(c))
+        return (int) PTR_ERR(c);
+    /* Bounded by the timeout work, which fails the command after the cancellation timeout at the latest */
+    wait_for_completion(&c->completion);
+    *res = c->res;
+    status = c->status;
+    cancel_delayed_work_sync(&c->w_timeout);
+    bce_vhci_command_release(c);
     return status;
 }
@@ -2,6 +2,8 @@
 #define BCE_VHCI_QUEUE_H
 
 #include <linux/completion.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 #include "../queue.h"
 
 #define VHCI_EVENT_QUEUE_EL_COUNT 256
@@ -42,15 +44,35 @@ struct bce_vhci_event_queue {
     dma_addr_t dma_addr;
     bce_vhci_event_queue_callback cb;
 };
-struct bce_vhci_command_queue_completion {
-    struct bce_vhci_message *result;
+/* Commands that may be outstanding at once, each with a different command code, which is what a reply is matched by */
+#define BCE_VHCI_CMD_MAX_PENDING 16
+
+struct bce_vhci_command_queue;
+/* Called once the command got its reply, timed out or was aborted; runs from the event path and must not sleep */
+typedef void (*bce_vhci_command_callback)(struct bce_vhci_command_queue *cq, struct bce_vhci_message *res,
+        int status, void *ctx);
+struct bce_vhci_pending_command {
+    struct bce_vhci_command_queue *cq;
+    struct bce_vhci_message req;
+    struct bce_vhci_message res;
+    int status;
+    u64 seq;
+    u64 timeout_seq; /* the seq w_timeout was queued for, a run for an earlier use of the slot bails out */
+    bool in_use;
+    bool done;
+    bool cancelling;
+    bce_vhci_command_callback cb;
+    void *ctx;
     struct completion completion;
+    struct delayed_work w_timeout;
 };
 struct bce_vhci_command_queue {
     struct bce_vhci_message_queue *mq;
-    struct bce_vhci_command_queue_completion completion;
-    struct spinlock completion_lock;
-    struct mutex mutex;
+    struct bce_vhci_pending_command cmds[BCE_VHCI_CMD_MAX_PENDING];
+    struct spinlock lock;
+    wait_queue_head_t slot_wq;
+    u64 next_seq;
+    bool destroyed;
 };
 
 int bce_vhci_message_queue_create(struct bce_vhci *vhci, struct bce_vhci_message_queue *ret, const char *name);
@@ -68,6 +90,8 @@ void bce_vhci_command_queue_create(struct bce_vhci_command_queue *ret, struct bc
 void bce_vhci_command_queue_destroy(struct bce_vhci_command_queue *cq);
 int bce_vhci_command_queue_execute(struct bce_vhci_command_queue *cq, struct bce_vhci_message *req,
         struct bce_vhci_message *res, unsigned long timeout);
+int bce_vhci_command_queue_submit(struct bce_vhci_command_queue *cq, struct bce_vhci_message *req,
+        unsigned long timeout, bce_vhci_command_callback cb, void *ctx);
 void bce_vhci_command_queue_deliver_completion(struct bce_vhci_command_queue *cq, struct bce_vhci_message *msg);
 
 #endif //BCE_VHCI_QUEUE_H
@@ -4,18 +4,79 @@
 #include "../apple_bce.h"
 #include <linux/usb/hcd.h>
 
-static void bce_vhci_transfer_queue_completion(struct bce_queue_sq *sq);
+static void bce_vhci_transfer_queue_completion(struct bce_queue_sq *sq, struct bce_qe_completion *e, u32 count);
 
 static int bce_vhci_urb_update(struct bce_vhci_urb *urb, struct bce_vhci_message *msg);
-static int bce_vhci_urb_transfer_completion(struct bce_vhci_urb *urb, struct bce_sq_completion_data *c);
+static int bce_vhci_urb_transfer_completion(struct bce_vhci_urb *urb, struct bce_qe_completion *c);
+static int bce_vhci_urb_iso_transfer_completion(struct bce_vhci_urb *urb, struct bce_qe_completion *c);
 
 static void bce_vhci_transfer_queue_reset_w(struct work_struct *work);
+static void bce_vhci_transfer_queue_cancel_w(struct work_struct *work);
+static struct bce_vhci_int_ring *bce_vhci_int_ring_create(struct bce_vhci *vhci,
+        struct usb_endpoint_descriptor *desc);
+static void bce_vhci_urb_complete(struct bce_vhci_urb *urb, int status);
+
+static enum bce_cq_vector_hint bce_vhci_endpoint_vector_hint(struct usb_endpoint_descriptor *desc)
+{
+    switch (usb_endpoint_type(desc)) {
+        case USB_ENDPOINT_XFER_INT:
+            return BCE_CQ_VECTOR_INTERRUPT;
+        case USB_ENDPOINT_XFER_BULK:
+        case USB_ENDPOINT_XFER_ISOC:
+            return BCE_CQ_VECTOR_BULK;
+        default:
+            return BCE_CQ_VECTOR_DEFAULT;
+    }
+}
+
+/* Called with the device lock held */
+static struct bce_vhci_shared_cq *bce_vhci_device_get_cq(struct bce_vhci *vhci, struct bce_vhci_device *vdev,
+        enum bce_cq_vector_hint vector, u32 sq_count)
+{
+    struct bce_vhci_shared_cq *scq;
+    list_for_each_entry(scq, &vdev->cqs, list) {
+        if (scq->vector == vector && scq->sq_count + sq_count <= BCE_VHCI_SHARED_CQ_MAX_SQS) {
+            scq->sq_count += sq_count;
+            return scq;
+        }
+    }
+    scq = kzalloc(sizeof(struct bce_vhci_shared_cq), GFP_KERNEL);
+    if (!scq)
+        return NULL;
+    scq->cq = bce_create_cq(vhci->dev, BCE_VHCI_SHARED_CQ_EL_COUNT, vector);
+    if (!scq->cq) {
+        kfree(scq);
+        return NULL;
+    }
+    /* Interrupt endpoints (HID) are latency sensitive, don't leave them at the mercy of interrupt coalescing */
+    if (vector == BCE_CQ_VECTOR_INTERRUPT)
+        bce_cq_poll_start(scq->cq);
+    scq->vector = vector;
+    scq->sq_count = sq_count;
+    list_add_tail(&scq->list, &vdev->cqs);
+    return scq;
+}
+
+static void bce_vhci_device_put_cq(struct bce_vhci *vhci, struct bce_vhci_shared_cq *scq, u32 sq_count)
+{
+    scq->sq_count -= sq_count;
+    if (scq->sq_count)
+        return;
+    list_del(&scq->list);
+    if (scq->vector == BCE_CQ_VECTOR_INTERRUPT)
+        bce_cq_poll_stop(scq->cq);
+    bce_destroy_cq(vhci->dev, scq->cq);
+    kfree(scq);
+}
 
 void bce_vhci_create_transfer_queue(struct bce_vhci *vhci, struct bce_vhci_transfer_queue *q,
         struct usb_host_endpoint *endp, bce_vhci_device_t dev_addr, enum dma_data_direction dir)
 {
     char name[0x21];
-    INIT_LIST_HEAD(&q->evq);
+    q->evq = kcalloc(BCE_VHCI_EVQ_SIZE, sizeof(struct bce_vhci_message), GFP_KERNEL);
+    q->evq_head = q->evq_tail = 0;
+    q->urb_pool = kcalloc(BCE_VHCI_URB_POOL_SIZE, sizeof(struct bce_vhci_urb), GFP_KERNEL);
+    bitmap_zero(q->urb_pool_used, BCE_VHCI_URB_POOL_SIZE);
     INIT_LIST_HEAD(&q->giveback_urb_list);
     spin_lock_init(&q->urb_lock);
     q->vhci = vhci;
@@ -24,36 +85,203 @@ void bce_vhci_create_transfer_queue(struct bce_vhci *vhci, struct bce_vhci_trans
     q->endp_addr = (u8) (endp->desc.bEndpointAddress & 0x8F);
     q->state = BCE_VHCI_ENDPOINT_ACTIVE;
     q->active = true;
-    q->cq = bce_create_cq(vhci->dev, 0x100);
+    q->stalled = false;
+    q->fw_paused = false;
+    q->int_ring = NULL;
+    q->sq_in = q->sq_out = NULL;
+    q->sq_in_urbs = q->sq_out_urbs = NULL;
+    q->msg_queue = usb_endpoint_xfer_isoc(&endp->desc) ? &vhci->msg_isochronous : &vhci->msg_asynchronous;
+    if (usb_endpoint_is_int_in(&endp->desc))
+        q->int_ring = bce_vhci_int_ring_create(vhci, &endp->desc);
+    q->shared_cq_sqs = dir == DMA_BIDIRECTIONAL ? 2 : 1;
+    q->shared_cq = bce_vhci_device_get_cq(vhci, vhci->devices[dev_addr],
+            bce_vhci_endpoint_vector_hint(&endp->desc), q->shared_cq_sqs);
+    q->cq = q->shared_cq ? q->shared_cq->cq : NULL;
     INIT_WORK(&q->w_reset, bce_vhci_transfer_queue_reset_w);
+    INIT_WORK(&q->w_cancel, bce_vhci_transfer_queue_cancel_w);
     if (dir == DMA_FROM_DEVICE || dir == DMA_BIDIRECTIONAL) {
         snprintf(name, sizeof(name), "VHC1-%i-%02x", dev_addr, 0x80 | usb_endpoint_num(&endp->desc));
-        q->sq_in = bce_create_sq(vhci->dev, q->cq, name, 0x100, DMA_FROM_DEVICE,
-                                 bce_vhci_transfer_queue_completion, q);
+        q->sq_in = bce_create_sq(vhci->dev, q->cq, name, BCE_VHCI_TQ_SQ_EL_COUNT, DMA_FROM_DEVICE, NULL, q);
+        if (q->sq_in) {
+            bce_sq_enable_direct_completion(q->sq_in, bce_vhci_transfer_queue_completion);
+            q->sq_in_urbs = kcalloc(q->sq_in->el_count, sizeof(struct bce_vhci_urb *), GFP_KERNEL);
+        }
     }
     if (dir == DMA_TO_DEVICE || dir == DMA_BIDIRECTIONAL) {
         snprintf(name, sizeof(name), "VHC1-%i-%02x", dev_addr, usb_endpoint_num(&endp->desc));
-        q->sq_out = bce_create_sq(vhci->dev, q->cq, name, 0x100, DMA_TO_DEVICE,
-                                  bce_vhci_transfer_queue_completion, q);
+        q->sq_out = bce_create_sq(vhci->dev, q->cq, name, BCE_VHCI_TQ_SQ_EL_COUNT, DMA_TO_DEVICE, NULL, q);
+        if (q->sq_out) {
+            bce_sq_enable_direct_completion(q->sq_out, bce_vhci_transfer_queue_completion);
+            q->sq_out_urbs = kcalloc(q->sq_out->el_count, sizeof(struct bce_vhci_urb *), GFP_KERNEL);
+        }
     }
 }
 
+/*
+ * The endpoint must not have any URBs left and the firmware must not route events to it anymore. Called with the
+ * device lock held.
+ */
 void bce_vhci_destroy_transfer_queue(struct bce_vhci *vhci, struct bce_vhci_transfer_queue *q)
 {
+    cancel_work_sync(&q->w_reset);
+    cancel_work_sync(&q->w_cancel);
     if (q->sq_in)
         bce_destroy_sq(vhci->dev, q->sq_in);
     if (q->sq_out)
         bce_destroy_sq(vhci->dev, q->sq_out);
-    bce_destroy_cq(vhci->dev, q->cq);
+    if (q->shared_cq)
+        bce_vhci_device_put_cq(vhci, q->shared_cq, q->shared_cq_sqs);
+    kfree(q->sq_in_urbs);
+    kfree(q->sq_out_urbs);
+    kfree(q->urb_pool);
+    kfree(q->evq);
+    if (q->int_ring) {
+        bce_dma_free(vhci->dev, BCE_DMA_VHCI, q->int_ring->buf_size * BCE_VHCI_INT_RING_SIZE, q->int_ring->data,
+                q->int_ring->dma_addr);
+        kfree(q->int_ring);
+    }
+    q->sq_in = q->sq_out = NULL;
+    q->sq_in_urbs = q->sq_out_urbs = NULL;
+    q->urb_pool = NULL;
+    q->evq = NULL;
+    q->int_ring = NULL;
+    q->shared_cq = NULL;
+    q->cq = NULL;
+}
+
+/* Ring and buffer memory of the endpoint, for the queue report */
+size_t bce_vhci_transfer_queue_dma_bytes(struct bce_vhci_transfer_queue *q)
+{
+    size_t ret = 0;
+    if (q->sq_in)
+        ret += q->sq_in->alloc_count * q->sq_in->el_size;
+    if (q->sq_out)
+        ret += q->sq_out->alloc_count * q->sq_out->el_size;
+    if (q->int_ring)
+        ret += q->int_ring->buf_size * BCE_VHCI_INT_RING_SIZE;
+    return ret;
+}
+
+static struct bce_vhci_int_ring *bce_vhci_int_ring_create(struct bce_vhci *vhci,
+        struct usb_endpoint_descriptor *desc)
+{
+    struct bce_vhci_int_ring *r = kzalloc(sizeof(struct bce_vhci_int_ring), GFP_KERNEL);
+    if (!r)
+        return NULL;
+    r->buf_size = usb_endpoint_maxp(desc) * usb_endpoint_maxp_mult(desc);
+    r->data = bce_dma_alloc(vhci->dev, BCE_DMA_VHCI, r->buf_size * BCE_VHCI_INT_RING_SIZE, &r->dma_addr);
+    if (!r->data) {
+        pr_err("bce-vhci: Failed to allocate the interrupt endpoint buffers, falling back to per URB transfers\n");
+        kfree(r);
+        return NULL;
+    }
+    return r;
+}
+
+/* Keeps every free buffer of the ring posted to the firmware */
+static void bce_vhci_int_ring_fill(struct bce_vhci_transfer_queue *q)
+{
+    struct bce_vhci_int_ring *r = q->int_ring;
+    struct bce_vhci_message msg;
+    struct bce_qe_submission *s;
+    u32 i;
+    if (!q->active || !q->sq_in)
+        return;
+    msg.cmd = BCE_VHCI_CMD_TRANSFER_REQUEST;
+    msg.status = 0;
+    msg.param1 = ((u32) q->endp_addr << 8) | q->dev_addr;
+    msg.param2 = r->buf_size;
+    while (r->posted - r->consumed < BCE_VHCI_INT_RING_SIZE) {
+        if (bce_reserve_submission_pair(q->msg_queue->sq, q->sq_in, NULL))
+            break;
+        i = r->posted++ % BCE_VHCI_INT_RING_SIZE;
+        bce_vhci_message_queue_write(q->msg_queue, &msg);
+        q->sq_in_urbs[q->sq_in->tail] = NULL;
+        s = bce_next_submission(q->sq_in);
+        bce_set_submission_single(s, r->dma_addr + i * r->buf_size, r->buf_size);
+    }
+}
+
+static void bce_vhci_int_ring_completion(struct bce_vhci_transfer_queue *q, struct bce_qe_completion *c)
+{
+    struct bce_vhci_int_ring *r = q->int_ring;
+    if (r->completed == r->posted) {
+        pr_err("bce-vhci: [%02x] Interrupt endpoint completion without a posted buffer\n", q->endp_addr);
+        return;
+    }
+    r->length[r->completed++ % BCE_VHCI_INT_RING_SIZE] =
+            c->status == BCE_COMPLETION_SUCCESS ? (s32) min_t(u64, c->data_size, r->buf_size) : -1;
+}
+
+/* The ring's URBs are not DMA mapped, see bce_vhci_map_urb_for_dma */
+static int bce_vhci_int_ring_copy(struct urb *urb, void *data, u32 len, u32 offset)
+{
+    if (urb->transfer_buffer) {
+        memcpy((u8 *) urb->transfer_buffer + offset, data, len);
+        return 0;
+    }
+    if (urb->num_sgs && sg_pcopy_from_buffer(urb->sg, urb->num_sgs, data, len, offset) == len)
+        return 0;
+    return -EINVAL;
+}
+
+/*
+ * Hands the completed reports to the waiting URBs, oldest first. A buffer filled up to buf_size means the transfer
+ * did not end with a short packet, so a report longer than one buffer carries on in the next one, until a short one
+ * or a full URB ends it. Data that doesn't fit completes the URB with -EOVERFLOW.
+ */
+static void bce_vhci_int_ring_deliver(struct bce_vhci_transfer_queue *q)
+{
+    struct bce_vhci_int_ring *r = q->int_ring;
+    struct bce_vhci_urb *vurb;
+    struct urb *urb;
+    u32 i, len, room;
+    int status;
+    while (r->consumed != r->completed) {
+        i = r->consumed % BCE_VHCI_INT_RING_SIZE;
+        if (r->length[i] < 0) { /* aborted by a flush, repost it */
+            ++r->consumed;
+            continue;
+        }
+        if (list_empty(&q->endp->urb_list))
+            break;
+        urb = list_first_entry(&q->endp->urb_list, struct urb, urb_list);
+        vurb = urb->hcpriv;
+        ++r->consumed;
+        room = urb->transfer_buffer_length - vurb->receive_offset;
+        len = min((u32) r->length[i], room);
+        if (bce_vhci_int_ring_copy(urb, (u8 *) r->data + i * r->buf_size, len, vurb->receive_offset)) {
+            pr_err("bce-vhci: [%02x] Interrupt URB without a transfer buffer\n", q->endp_addr);
+            bce_vhci_urb_complete(vurb, -EINVAL);
+            continue;
+        }
+        vurb->receive_offset += len;
+        if ((u32) r->length[i] > room)
+            status = -EOVERFLOW;
+        else if ((u32) r->length[i] == r->buf_size && vurb->receive_offset < urb->transfer_buffer_length)
+            continue; /* the rest of the report is in the next buffer */
+        else
+            status = 0;
+        urb->actual_length = vurb->receive_offset;
+        bce_vhci_urb_complete(vurb, status);
+    }
+}
+
+static bool bce_vhci_transfer_queue_evq_empty(struct bce_vhci_transfer_queue *q)
+{
+    return q->evq_head == q->evq_tail;
 }
 
 static void bce_vhci_transfer_queue_defer_event(struct bce_vhci_transfer_queue *q, struct bce_vhci_message *msg)
 {
-    struct bce_vhci_list_message *lm;
-    lm = kmalloc(sizeof(struct bce_vhci_list_message), GFP_KERNEL);
-    INIT_LIST_HEAD(&lm->list);
-    lm->msg = *msg;
-    list_add_tail(&lm->list, &q->evq);
+    BUILD_BUG_ON(BCE_VHCI_EVQ_SIZE & (BCE_VHCI_EVQ_SIZE - 1));
+    if (!q->evq || q->evq_tail - q->evq_head == BCE_VHCI_EVQ_SIZE) {
+        /* Dropping the event would leave the endpoint waiting forever, resynchronize with the firmware instead */
+        pr_err("bce-vhci: [%02x] Too many deferred events, resetting the endpoint\n", q->endp_addr);
+        bce_vhci_transfer_queue_request_reset(q);
+        return;
+    }
+    q->evq[q->evq_tail++ % BCE_VHCI_EVQ_SIZE] = *msg;
 }
 
 static void bce_vhci_transfer_queue_giveback(struct bce_vhci_transfer_queue *q)
@@ -72,32 +300,70 @@ static void bce_vhci_transfer_queue_giveback(struct bce_vhci_transfer_queue *q)
     spin_unlock_irqrestore(&q->urb_lock, flags);
 }
 
-void bce_vhci_transfer_queue_deliver_pending(struct bce_vhci_transfer_queue *q)
+/*
+ * The data path only fills the submissions; the doorbells are written once the whole batch of events or completions
+ * has been processed.
+ */
+static void bce_vhci_transfer_queue_kick(struct bce_vhci_transfer_queue *q)
+{
+    if (q->sq_in)
+        bce_submit_to_device(q->sq_in);
+    if (q->sq_out)
+        bce_submit_to_device(q->sq_out);
+}
+
+/* An OUT URB that was only partly sent when the firmware asked for less than all of it still needs more requests */
+static bool bce_vhci_urb_has_unsent_data(struct bce_vhci_urb *vurb)
+{
+    return vurb->dir == DMA_TO_DEVICE && !vurb->is_iso && vurb->state == BCE_VHCI_URB_WAITING_FOR_COMPLETION &&
+           vurb->send_offset < vurb->urb->transfer_buffer_length;
+}
+
+/*
+ * Data endpoints can have several URBs in flight, a transfer request is for the oldest URB that still has data to
+ * send or is waiting for one. Everything else, and all the messages of control endpoints, are for the oldest URB.
+ */
+static struct bce_vhci_urb *bce_vhci_transfer_queue_event_urb(struct bce_vhci_transfer_queue *q,
+        struct bce_vhci_message *msg)
 {
     struct urb *urb;
-    struct bce_vhci_list_message *lm;
+    struct bce_vhci_urb *vurb, *first;
+    if (list_empty(&q->endp->urb_list))
+        return NULL;
+    first = list_first_entry(&q->endp->urb_list, struct urb, urb_list)->hcpriv;
+    if (first->is_control || msg->cmd != BCE_VHCI_CMD_TRANSFER_REQUEST)
+        return first;
+    list_for_each_entry(urb, &q->endp->urb_list, urb_list) {
+        vurb = urb->hcpriv;
+        if (vurb->state == BCE_VHCI_URB_WAITING_FOR_TRANSFER_REQUEST || bce_vhci_urb_has_unsent_data(vurb))
+            return vurb;
+    }
+    return first;
+}
 
-    while (!list_empty(&q->endp->urb_list) && !list_empty(&q->evq)) {
-        urb = list_first_entry(&q->endp->urb_list, struct urb, urb_list);
+void bce_vhci_transfer_queue_deliver_pending(struct bce_vhci_transfer_queue *q)
+{
+    struct bce_vhci_message *msg;
 
-        lm = list_first_entry(&q->evq, struct bce_vhci_list_message, list);
-        if (bce_vhci_urb_update(urb->hcpriv, &lm->msg) == -EAGAIN)
+    if (q->int_ring) {
+        bce_vhci_int_ring_deliver(q);
+        bce_vhci_int_ring_fill(q);
+    }
+
+    while (!list_empty(&q->endp->urb_list) && !bce_vhci_transfer_queue_evq_empty(q)) {
+        msg = &q->evq[q->evq_head % BCE_VHCI_EVQ_SIZE];
+        if (bce_vhci_urb_update(bce_vhci_transfer_queue_event_urb(q, msg), msg) == -EAGAIN)
             break;
-        list_del(&lm->list);
-        kfree(lm);
+        ++q->evq_head;
     }
+    bce_vhci_transfer_queue_kick(q);
 }
 
 static void bce_vhci_transfer_queue_remove_pending(struct bce_vhci_transfer_queue *q)
 {
     unsigned long flags;
-    struct bce_vhci_list_message *lm;
     spin_lock_irqsave(&q->urb_lock, flags);
-    while (!list_empty(&q->evq)) {
-        lm = list_first_entry(&q->evq, struct bce_vhci_list_message, list);
-        list_del(&lm->list);
-        kfree(lm);
-    }
+    q->evq_head = q->evq_tail;
     spin_unlock_irqrestore(&q->urb_lock, flags);
 }
 
@@ -105,12 +371,11 @@ void bce_vhci_transfer_queue_event(struct bce_vhci_transfer_queue *q, struct bce
 {
     unsigned long flags;
     struct bce_vhci_urb *turb;
-    struct urb *urb;
     spin_lock_irqsave(&q->urb_lock, flags);
     bce_vhci_transfer_queue_deliver_pending(q);
 
     if (msg->cmd == BCE_VHCI_CMD_TRANSFER_REQUEST &&
-        (!list_empty(&q->evq) || list_empty(&q->endp->urb_list))) {
+        (!bce_vhci_transfer_queue_evq_empty(q) || list_empty(&q->endp->urb_list))) {
         bce_vhci_transfer_queue_defer_event(q, msg);
         goto complete;
     }
@@ -118,42 +383,73 @@ void bce_vhci_transfer_queue_event(struct bce_vhci_transfer_queue *q, struct bce
         pr_err("bce-vhci: [%02x] Unexpected transfer queue event\n", q->endp_addr);
         goto complete;
     }
-    urb = list_first_entry(&q->endp->urb_list, struct urb, urb_list);
-    turb = urb->hcpriv;
+    turb = bce_vhci_transfer_queue_event_urb(q, msg);
     if (bce_vhci_urb_update(turb, msg) == -EAGAIN)
         bce_vhci_transfer_queue_defer_event(q, msg);
+    bce_vhci_transfer_queue_kick(q);
 
 complete:
     spin_unlock_irqrestore(&q->urb_lock, flags);
     bce_vhci_transfer_queue_giveback(q);
 }
 
-static void bce_vhci_transfer_queue_completion(struct bce_queue_sq *sq)
+/* Direct completion mode, the completions are read in place from the CQ ring */
+static void bce_vhci_transfer_queue_completion(struct bce_queue_sq *sq, struct bce_qe_completion *e, u32 count)
 {
     unsigned long flags;
-    struct bce_sq_completion_data *c;
-    struct urb *urb;
+    struct bce_qe_completion *c;
+    struct bce_vhci_urb *vurb;
     struct bce_vhci_transfer_queue *q = sq->userdata;
+    struct bce_vhci_urb **urbs = sq == q->sq_in ? q->sq_in_urbs : q->sq_out_urbs;
     spin_lock_irqsave(&q->urb_lock, flags);
-    while ((c = bce_next_completion(sq))) {
+    for (c = e; c != e + count; c++) {
+        /* The completions come in submission order, the slot tells which URB the submission was for */
+        if (q->int_ring && sq == q->sq_in) {
+            bce_notify_submission_complete(sq);
+            bce_vhci_int_ring_completion(q, c);
+            continue;
+        }
+        vurb = urbs[c->completion_index];
+        urbs[c->completion_index] = NULL;
+        bce_notify_submission_complete(sq);
+        if (vurb)
+            --vurb->posted;
+        if (vurb && vurb->is_iso) { /* every packet gets a status, even an aborted one */
+            bce_vhci_urb_iso_transfer_completion(vurb, c);
+            continue;
+        }
         if (c->status == BCE_COMPLETION_ABORTED) { /* We flushed the queue */
             pr_debug("bce-vhci: [%02x] Got an abort completion\n", q->endp_addr);
             continue;
         }
-        if (list_empty(&q->endp->urb_list)) {
+        if (!vurb) {
             pr_err("bce-vhci: [%02x] Got a completion while no requests are pending\n", q->endp_addr);
             continue;
         }
         pr_debug("bce-vhci: [%02x] Got a transfer queue completion\n", q->endp_addr);
-        urb = list_first_entry(&q->endp->urb_list, struct urb, urb_list);
-        bce_vhci_urb_transfer_completion(urb->hcpriv, c);
-        bce_notify_submission_complete(sq);
+        bce_vhci_urb_transfer_completion(vurb, c);
     }
     bce_vhci_transfer_queue_deliver_pending(q);
     spin_unlock_irqrestore(&q->urb_lock, flags);
     bce_vhci_transfer_queue_giveback(q);
 }
 
+/* Flushes both directions of the endpoint, with the two firmware round-trips overlapped */
+static void bce_vhci_transfer_queue_flush(struct bce_vhci_transfer_queue *q)
+{
+    struct bce_queue_cmdq *cmdq = q->vhci->dev->cmd_cmdq;
+    struct bce_queue_cmdq_result_el res_in, res_out;
+    bool wait_in = false, wait_out = false;
+    if (q->sq_in)
+        wait_in = !bce_cmd_flush_memory_queue_async(cmdq, (u16) q->sq_in->qid, &res_in, NULL, NULL);
+    if (q->sq_out)
+        wait_out = !bce_cmd_flush_memory_queue_async(cmdq, (u16) q->sq_out->qid, &res_out, NULL, NULL);
+    if (wait_in)
+        bce_cmd_wait(cmdq, &res_in, MAX_SCHEDULE_TIMEOUT);
+    if (wait_out)
+        bce_cmd_wait(cmdq, &res_out, MAX_SCHEDULE_TIMEOUT);
+}
+
 int bce_vhci_transfer_queue_pause(struct bce_vhci_transfer_queue *q)
 {
     unsigned long flags;
@@ -171,10 +467,7 @@ int bce_vhci_transfer_queue_pause(struct bce_vhci_transfer_queue *q)
         return status;
     if (q->state != BCE_VHCI_ENDPOINT_PAUSED)
         return -EINVAL;
-    if (q->sq_in)
-        bce_cmd_flush_memory_queue(q->vhci->dev->cmd_cmdq, (u16) q->sq_in->qid);
-    if (q->sq_out)
-        bce_cmd_flush_memory_queue(q->vhci->dev->cmd_cmdq, (u16) q->sq_out->qid);
+    bce_vhci_transfer_queue_flush(q);
     return 0;
 }
 
@@ -215,10 +508,7 @@ static void bce_vhci_transfer_queue_reset_w(struct work_struct *work)
     }
     spin_unlock_irqrestore(&q->urb_lock, flags);
     bce_vhci_transfer_queue_remove_pending(q);
-    if (q->sq_in)
-        bce_cmd_flush_memory_queue(q->vhci->dev->cmd_cmdq, (u16) q->sq_in->qid);
-    if (q->sq_out)
-        bce_cmd_flush_memory_queue(q->vhci->dev->cmd_cmdq, (u16) q->sq_out->qid);
+    bce_vhci_transfer_queue_flush(q);
     bce_vhci_cmd_endpoint_reset(&q->vhci->cq, q->dev_addr, (u8) (q->endp->desc.bEndpointAddress & 0x8F));
     q->fw_paused = false;
     spin_lock_irqsave(&q->urb_lock, flags);
@@ -236,26 +526,42 @@ void bce_vhci_transfer_queue_request_reset(struct bce_vhci_transfer_queue *q)
 
 static int bce_vhci_urb_init(struct bce_vhci_urb *vurb);
 static int bce_vhci_urb_data_start(struct bce_vhci_urb *urb, unsigned long *timeout);
+static struct bce_vhci_urb *bce_vhci_urb_alloc(struct bce_vhci_transfer_queue *q, gfp_t mem_flags);
+static void bce_vhci_urb_free(struct bce_vhci_urb *urb);
 
-int bce_vhci_urb_create(struct bce_vhci_transfer_queue *q, struct urb *urb)
+int bce_vhci_urb_create(struct bce_vhci_transfer_queue *q, struct urb *urb, gfp_t mem_flags)
 {
     unsigned long flags;
     int status = 0;
     struct bce_vhci_urb *vurb;
-    vurb = kzalloc(sizeof(struct bce_vhci_urb), GFP_KERNEL);
+    vurb = bce_vhci_urb_alloc(q, mem_flags);
+    if (!vurb)
+        return -ENOMEM;
     urb->hcpriv = vurb;
 
     vurb->q = q;
     vurb->urb = urb;
     vurb->dir = usb_urb_dir_in(urb) ? DMA_FROM_DEVICE : DMA_TO_DEVICE;
     vurb->is_control = (usb_endpoint_num(&urb->ep->desc) == 0);
+    vurb->is_iso = usb_pipeisoc(urb->pipe);
+    /* The USB core has mapped the SG list already, it only needs a segment list for the firmware */
+    if (urb->num_mapped_sgs) {
+        status = bce_map_dma_buffer_premapped(q->vhci->dev, &vurb->sg_buf, urb->sg,
+                urb->num_mapped_sgs, vurb->dir, mem_flags);
+        if (status) {
+            urb->hcpriv = NULL;
+            bce_vhci_urb_free(vurb);
+            return status;
+        }
+        vurb->has_sg = true;
+    }
 
     spin_lock_irqsave(&q->urb_lock, flags);
     status = usb_hcd_link_urb_to_ep(q->vhci->hcd, urb);
     if (status) {
         spin_unlock_irqrestore(&q->urb_lock, flags);
         urb->hcpriv = NULL;
-        kfree(vurb);
+        bce_vhci_urb_free(vurb);
         return status;
     }
 
@@ -269,13 +575,15 @@ int bce_vhci_urb_create(struct bce_vhci_transfer_queue *q, struct urb *urb)
     if (status) {
         usb_hcd_unlink_urb_from_ep(q->vhci->hcd, urb);
         urb->hcpriv = NULL;
-        kfree(vurb);
+        bce_vhci_urb_free(vurb);
     } else {
         bce_vhci_transfer_queue_deliver_pending(q);
     }
     spin_unlock_irqrestore(&q->urb_lock, flags);
     pr_debug("bce-vhci: [%02x] URB enqueued (dir = %s, size = %i)\n", q->endp_addr,
             usb_urb_dir_in(urb) ? "IN" : "OUT", urb->transfer_buffer_length);
+    if (q->int_ring)
+        bce_vhci_transfer_queue_giveback(q); /* a report may have been waiting for this URB already */
     return status;
 }
 
@@ -289,6 +597,76 @@ static int bce_vhci_urb_init(struct bce_vhci_urb *vurb)
     }
 }
 
+/* Takes the next submission of sq, on behalf of urb */
+static struct bce_qe_submission *bce_vhci_urb_next_submission(struct bce_vhci_urb *urb, struct bce_queue_sq *sq)
+{
+    struct bce_vhci_urb **urbs = sq == urb->q->sq_in ? urb->q->sq_in_urbs : urb->q->sq_out_urbs;
+    urbs[sq->tail] = urb;
+    ++urb->posted;
+    return bce_next_submission(sq);
+}
+
+/* Called before a URB that still has submissions with the device is freed; their completions are dropped */
+static void bce_vhci_urb_forget_submissions(struct bce_vhci_urb *urb)
+{
+    struct bce_vhci_transfer_queue *q = urb->q;
+    u32 i;
+    if (!urb->posted)
+        return;
+    for (i = 0; q->sq_in && i < q->sq_in->el_count; i++) {
+        if (q->sq_in_urbs[i] == urb)
+            q->sq_in_urbs[i] = NULL;
+    }
+    for (i = 0; q->sq_out && i < q->sq_out->el_count; i++) {
+        if (q->sq_out_urbs[i] == urb)
+            q->sq_out_urbs[i] = NULL;
+    }
+    urb->posted = 0;
+}
+
+/* Takes a zeroed bce_vhci_urb from the queue's pool, without touching the allocator unless the pool is exhausted */
+static struct bce_vhci_urb *bce_vhci_urb_alloc(struct bce_vhci_transfer_queue *q, gfp_t mem_flags)
+{
+    struct bce_vhci_urb *vurb;
+    unsigned long i;
+    do {
+        i = find_first_zero_bit(q->urb_pool_used, BCE_VHCI_URB_POOL_SIZE);
+        if (i >= BCE_VHCI_URB_POOL_SIZE || !q->urb_pool) {
+            vurb = kzalloc(sizeof(struct bce_vhci_urb), mem_flags);
+            if (vurb)
+                vurb->q = q;
+            return vurb;
+        }
+    } while (test_and_set_bit(i, q->urb_pool_used));
+    vurb = &q->urb_pool[i];
+    memset(vurb, 0, sizeof(struct bce_vhci_urb));
+    vurb->q = q;
+    return vurb;
+}
+
+/* Called with urb_lock held; the premapped segment list is a pooled page, so releasing it does not sleep */
+static void bce_vhci_urb_free(struct bce_vhci_urb *urb)
+{
+    struct bce_vhci_transfer_queue *q = urb->q;
+    bce_vhci_urb_forget_submissions(urb);
+    if (urb->has_sg)
+        bce_unmap_dma_buffer_premapped(q->vhci->dev, &urb->sg_buf);
+    if (q->urb_pool && urb >= q->urb_pool && urb < q->urb_pool + BCE_VHCI_URB_POOL_SIZE)
+        clear_bit((unsigned int) (urb - q->urb_pool), q->urb_pool_used);
+    else
+        kfree(urb);
+}
+
+/* Points s at len bytes of the URB's data at offset, either in transfer_dma or through the SG segment list */
+static void bce_vhci_urb_set_data_submission(struct bce_vhci_urb *urb, struct bce_qe_submission *s, u32 offset,
+        u32 len)
+{
+    if (urb->has_sg)
+        bce_set_submission_buf(s, &urb->sg_buf, offset, len);
+    else
+        bce_set_submission_single(s, urb->urb->transfer_dma + offset, len);
+}
+
 static void bce_vhci_urb_complete(struct bce_vhci_urb *urb, int status)
 {
     struct bce_vhci_transfer_queue *q = urb->q;
@@ -298,62 +676,139 @@ static void bce_vhci_urb_complete(struct bce_vhci_urb *urb, int status)
     usb_hcd_unlink_urb_from_ep(vhci->hcd, real_urb);
     real_urb->hcpriv = NULL;
     real_urb->status = status;
-    kfree(urb);
+    bce_vhci_urb_free(urb);
     list_add_tail(&real_urb->urb_list, &q->giveback_urb_list);
 }
 
-static int bce_vhci_urb_remove(struct bce_vhci_transfer_queue *q, struct urb *urb, int status)
+/* Unlinks the URB and queues it for giveback with its unlink status */
+static void bce_vhci_urb_remove(struct bce_vhci_urb *vurb)
 {
-    unsigned long flags;
-    int ret = 0;
-    struct bce_vhci_urb *vurb;
-    spin_lock_irqsave(&q->urb_lock, flags);
-    if ((ret = usb_hcd_check_unlink_urb(q->vhci->hcd, urb, status))) {
-        spin_unlock_irqrestore(&q->urb_lock, flags);
-        return ret;
-    }
-    vurb = urb->hcpriv;
+    struct bce_vhci_transfer_queue *q = vurb->q;
+    struct urb *urb = vurb->urb;
     usb_hcd_unlink_urb_from_ep(q->vhci->hcd, urb);
-    bce_vhci_transfer_queue_deliver_pending(q); /* TODO: Probably not the right place? */
-    spin_unlock_irqrestore(&q->urb_lock, flags);
-    kfree(vurb);
-    usb_hcd_giveback_urb(q->vhci->hcd, urb, status);
-    return ret;
+    urb->hcpriv = NULL;
+    urb->status = urb->unlinked;
+    bce_vhci_urb_free(vurb);
+    list_add_tail(&urb->urb_list, &q->giveback_urb_list);
 }
 
-static void bce_vhci_urb_cancel_w(struct work_struct *ws)
+/* Whether the firmware can't have any part of the URB yet, so it can be dropped without pausing the endpoint */
+static bool bce_vhci_urb_is_host_only(struct bce_vhci_urb *vurb)
 {
-    struct bce_vhci_transfer_queue_urb_cancel_work *w =
-            container_of(ws, struct bce_vhci_transfer_queue_urb_cancel_work, ws);
+    if (vurb->posted)
+        return false;
+    if (vurb->state == BCE_VHCI_URB_INIT_PAUSED)
+        return true;
+    if (vurb->is_control)
+        return false; /* the firmware tracks the control stages, even before the setup packet was sent */
+    if (vurb->q->int_ring)
+        return true; /* the posted buffers belong to the ring, not to the URB */
+    return vurb->state == BCE_VHCI_URB_WAITING_FOR_TRANSFER_REQUEST && !vurb->iso_posted;
+}
 
-    pr_debug("bce-vhci: [%02x] Cancelling URB\n", w->q->endp_addr);
-    bce_vhci_transfer_queue_pause(w->q);
-    bce_vhci_urb_remove(w->q, w->urb, w->status);
-    if (!w->q->fw_paused)
-        bce_vhci_transfer_queue_resume(w->q);
-    kfree(w);
+/*
+ * Pauses and flushes the endpoint once for all the URBs that were cancelled while the firmware might own them; more
+ * cancels arriving before this runs just join the batch.
+ */
+static void bce_vhci_transfer_queue_cancel_w(struct work_struct *work)
+{
+    unsigned long flags;
+    struct urb *urb, *urbt;
+    struct bce_vhci_transfer_queue *q = container_of(work, struct bce_vhci_transfer_queue, w_cancel);
+
+    pr_debug("bce-vhci: [%02x] Cancelling URBs\n", q->endp_addr);
+    bce_vhci_transfer_queue_pause(q);
+    spin_lock_irqsave(&q->urb_lock, flags);
+    list_for_each_entry_safe(urb, urbt, &q->endp->urb_list, urb_list) {
+        if (urb->unlinked)
+            bce_vhci_urb_remove(urb->hcpriv);
+    }
+    bce_vhci_transfer_queue_deliver_pending(q);
+    spin_unlock_irqrestore(&q->urb_lock, flags);
+    bce_vhci_transfer_queue_giveback(q);
+    if (!q->fw_paused)
+        bce_vhci_transfer_queue_resume(q);
 }
 
 int bce_vhci_urb_request_cancel(struct bce_vhci_transfer_queue *q, struct urb *urb, int status)
 {
-    struct bce_vhci_transfer_queue_urb_cancel_work *w;
     unsigned long flags;
     int ret;
 
-    /* Quick check to try to avoid pausing; must past 0 as status we won't be able to call it again. */
     spin_lock_irqsave(&q->urb_lock, flags);
-    if ((ret = usb_hcd_check_unlink_urb(q->vhci->hcd, urb, 0))) {
+    if ((ret = usb_hcd_check_unlink_urb(q->vhci->hcd, urb, status))) {
         spin_unlock_irqrestore(&q->urb_lock, flags);
         return ret;
     }
+    if (bce_vhci_urb_is_host_only(urb->hcpriv)) {
+        bce_vhci_urb_remove(urb->hcpriv);
+        bce_vhci_transfer_queue_deliver_pending(q);
+        spin_unlock_irqrestore(&q->urb_lock, flags);
+        bce_vhci_transfer_queue_giveback(q);
+        return 0;
+    }
     spin_unlock_irqrestore(&q->urb_lock, flags);
+    queue_work(q->vhci->tq_state_wq, &q->w_cancel);
+    return 0;
+}
+
+/*
+ * Isochronous URBs are sent as one transfer request per packet, all of them queued ahead at once so that the firmware
+ * always has the next intervals' buffers. Each packet completes on its own into its iso_frame_desc.
+ */
+static int bce_vhci_urb_iso_transfer_in(struct bce_vhci_urb *urb, unsigned long *timeout)
+{
+    struct bce_vhci_message msg;
+    struct bce_qe_submission *s;
+    struct usb_iso_packet_descriptor *desc;
 
-    w = kzalloc(sizeof(struct bce_vhci_transfer_queue_urb_cancel_work), GFP_KERNEL);
-    INIT_WORK(&w->ws, bce_vhci_urb_cancel_w);
-    w->q = q;
-    w->urb = urb;
-    w->status = status;
-    queue_work(q->vhci->tq_state_wq, &w->ws);
+    msg.cmd = BCE_VHCI_CMD_TRANSFER_REQUEST;
+    msg.status = 0;
+    msg.param1 = ((urb->urb->ep->desc.bEndpointAddress & 0x8Fu) << 8) | urb->q->dev_addr;
+    while (urb->iso_posted < urb->urb->number_of_packets) {
+        if (bce_reserve_submission_pair(urb->q->msg_queue->sq, urb->q->sq_in, timeout)) {
+            pr_err("bce-vhci: Failed to reserve a submission for isochronous packet %u\n", urb->iso_posted);
+            return urb->iso_posted ? 0 : -ENOMEM; /* the rest are posted as the first ones complete */
+        }
+        desc = &urb->urb->iso_frame_desc[urb->iso_posted++];
+        msg.param2 = desc->length;
+        bce_vhci_message_queue_write(urb->q->msg_queue, &msg);
+        s = bce_vhci_urb_next_submission(urb, urb->q->sq_in);
+        bce_vhci_urb_set_data_submission(urb, s, desc->offset, desc->length);
+    }
+    urb->state = BCE_VHCI_URB_WAITING_FOR_COMPLETION;
+    return 0;
+}
+
+static int bce_vhci_urb_iso_transfer_completion(struct bce_vhci_urb *urb, struct bce_qe_completion *c)
+{
+    struct bce_vhci_iso_stats *stats = &urb->q->vhci->iso_stats;
+    struct usb_iso_packet_descriptor *desc;
+    if (urb->iso_done >= urb->urb->number_of_packets) {
+        pr_err("bce-vhci: [%02x] Isochronous URB unexpected completion\n", urb->q->endp_addr);
+        return 0;
+    }
+    desc = &urb->urb->iso_frame_desc[urb->iso_done++];
+    atomic64_inc(&stats->packets);
+    if (c->status == BCE_COMPLETION_SUCCESS) {
+        desc->actual_length = (unsigned int) min_t(u64, c->data_size, desc->length);
+        desc->status = 0;
+        urb->urb->actual_length += desc->actual_length;
+        atomic64_add(desc->actual_length, &stats->bytes);
+    } else {
+        desc->actual_length = 0;
+        desc->status = -EXDEV;
+        ++urb->urb->error_count;
+        atomic64_inc(&stats->missed);
+    }
+    if (urb->dir == DMA_FROM_DEVICE && urb->iso_posted < urb->urb->number_of_packets &&
+        urb->state == BCE_VHCI_URB_WAITING_FOR_COMPLETION)
+        bce_vhci_urb_iso_transfer_in(urb, NULL);
+    if (urb->iso_done == urb->urb->number_of_packets) {
+        atomic64_inc(&stats->urbs);
+        bce_vhci_urb_complete(urb, 0);
+        return -ENOENT;
+    }
     return 0;
 }
 
@@ -362,20 +817,22 @@ static int bce_vhci_urb_data_transfer_in(struct bce_vhci_urb *urb, unsigned long
     struct bce_vhci_message msg;
     struct bce_qe_submission *s;
     u32 tr_len;
-    int reservation1, reservation2 = -EFAULT;
+
+    if (urb->is_iso)
+        return bce_vhci_urb_iso_transfer_in(urb, timeout);
+    if (urb->q->int_ring) {
+        /* the report arrives in one of the ring's buffers, see bce_vhci_int_ring_deliver */
+        urb->state = BCE_VHCI_URB_WAITING_FOR_COMPLETION;
+        return 0;
+    }
 
     pr_debug("bce-vhci: [%02x] DMA from device %llx %x\n", urb->q->endp_addr,
              (u64) urb->urb->transfer_dma, urb->urb->transfer_buffer_length);
 
     /* Reserve both a message and a submission, so we don't run into issues later. */
-    reservation1 = bce_reserve_submission(urb->q->vhci->msg_asynchronous.sq, timeout);
-    if (!reservation1)
-        reservation2 = bce_reserve_submission(urb->q->sq_in, timeout);
-    if (reservation1 || reservation2) {
+    if (bce_reserve_submission_pair(urb->q->msg_queue->sq, urb->q->sq_in, timeout)) {
         pr_err("bce-vhci: Failed to reserve a submission for URB data transfer\n");
         dump_stack();
-        if (!reservation1)
-            bce_cancel_submission_reservation(urb->q->vhci->msg_asynchronous.sq);
         return -ENOMEM;
     }
 
@@ -383,17 +840,14 @@ static int bce_vhci_urb_data_transfer_in(struct bce_vhci_urb *urb, unsigned long
 
     tr_len = urb->urb->transfer_buffer_length - urb->send_offset;
 
-    spin_lock(&urb->q->vhci->msg_asynchronous_lock);
     msg.cmd = BCE_VHCI_CMD_TRANSFER_REQUEST;
     msg.status = 0;
     msg.param1 = ((urb->urb->ep->desc.bEndpointAddress & 0x8Fu) << 8) | urb->q->dev_addr;
     msg.param2 = tr_len;
-    bce_vhci_message_queue_write(&urb->q->vhci->msg_asynchronous, &msg);
-    spin_unlock(&urb->q->vhci->msg_asynchronous_lock);
+    bce_vhci_message_queue_write(urb->q->msg_queue, &msg);
 
-    s = bce_next_submission(urb->q->sq_in);
-    bce_set_submission_single(s, urb->urb->transfer_dma + urb->send_offset, tr_len);
-    bce_submit_to_device(urb->q->sq_in);
+    s = bce_vhci_urb_next_submission(urb, urb->q->sq_in);
+    bce_vhci_urb_set_data_submission(urb, s, urb->send_offset, tr_len);
 
     urb->state = BCE_VHCI_URB_WAITING_FOR_COMPLETION;
     return 0;
@@ -412,20 +866,34 @@ static int bce_vhci_urb_data_start(struct bce_vhci_urb *urb, unsigned long *time
     }
 }
 
-static int bce_vhci_urb_send_out_data(struct bce_vhci_urb *urb, dma_addr_t addr, size_t size)
+static struct bce_qe_submission *bce_vhci_urb_reserve_out(struct bce_vhci_urb *urb)
 {
-    struct bce_qe_submission *s;
     unsigned long timeout = 0;
     if (bce_reserve_submission(urb->q->sq_out, &timeout)) {
         pr_err("bce-vhci: Failed to reserve a submission for URB data transfer\n");
-        return -EPIPE;
+        return NULL;
     }
+    return bce_vhci_urb_next_submission(urb, urb->q->sq_out);
+}
 
+static int bce_vhci_urb_send_out_data(struct bce_vhci_urb *urb, dma_addr_t addr, size_t size)
+{
+    struct bce_qe_submission *s;
+    if (!(s = bce_vhci_urb_reserve_out(urb)))
+        return -EPIPE;
     pr_debug("bce-vhci: [%02x] DMA to device %llx %lx\n", urb->q->endp_addr, (u64) addr, size);
-
-    s = bce_next_submission(urb->q->sq_out);
     bce_set_submission_single(s, addr, size);
-    bce_submit_to_device(urb->q->sq_out);
+    return 0;
+}
+
+/* Like bce_vhci_urb_send_out_data, for the URB's own data */
+static int bce_vhci_urb_send_out_buffer(struct bce_vhci_urb *urb, u32 offset, u32 size)
+{
+    struct bce_qe_submission *s;
+    if (!(s = bce_vhci_urb_reserve_out(urb)))
+        return -EPIPE;
+    pr_debug("bce-vhci: [%02x] DMA to device +%x %x\n", urb->q->endp_addr, offset, size);
+    bce_vhci_urb_set_data_submission(urb, s, offset, size);
     return 0;
 }
 
@@ -433,10 +901,22 @@ static int bce_vhci_urb_data_update(struct bce_vhci_urb *urb, struct bce_vhci_me
 {
     u32 tr_len;
     int status;
-    if (urb->state == BCE_VHCI_URB_WAITING_FOR_TRANSFER_REQUEST) {
+    struct usb_iso_packet_descriptor *desc;
+    if (urb->state == BCE_VHCI_URB_WAITING_FOR_TRANSFER_REQUEST && urb->is_iso) {
+        /* The firmware asks for the OUT packets one interval at a time */
+        if (msg->cmd == BCE_VHCI_CMD_TRANSFER_REQUEST) {
+            desc = &urb->urb->iso_frame_desc[urb->iso_posted];
+            tr_len = min(desc->length, (u32) msg->param2);
+            if ((status = bce_vhci_urb_send_out_buffer(urb, desc->offset, tr_len)))
+                return status;
+            if (++urb->iso_posted == urb->urb->number_of_packets)
+                urb->state = BCE_VHCI_URB_WAITING_FOR_COMPLETION;
+            return 0;
+        }
+    } else if (urb->state == BCE_VHCI_URB_WAITING_FOR_TRANSFER_REQUEST || bce_vhci_urb_has_unsent_data(urb)) {
         if (msg->cmd == BCE_VHCI_CMD_TRANSFER_REQUEST) {
             tr_len = min(urb->urb->transfer_buffer_length - urb->send_offset, (u32) msg->param2);
-            if ((status = bce_vhci_urb_send_out_data(urb, urb->urb->transfer_dma + urb->send_offset, tr_len)))
+            if ((status = bce_vhci_urb_send_out_buffer(urb, urb->send_offset, tr_len)))
                 return status;
             urb->send_offset += tr_len;
             urb->state = BCE_VHCI_URB_WAITING_FOR_COMPLETION;
@@ -453,7 +933,7 @@ static int bce_vhci_urb_data_update(struct bce_vhci_urb *urb, struct bce_vhci_me
     return -EAGAIN;
 }
 
-static int bce_vhci_urb_data_transfer_completion(struct bce_vhci_urb *urb, struct bce_sq_completion_data *c)
+static int bce_vhci_urb_data_transfer_completion(struct bce_vhci_urb *urb, struct bce_qe_completion *c)
 {
     if (urb->state == BCE_VHCI_URB_WAITING_FOR_COMPLETION) {
         urb->receive_offset += c->data_size;
@@ -529,7 +1009,7 @@ static int bce_vhci_urb_control_update(struct bce_vhci_urb *urb, struct bce_vhci
     return -EAGAIN;
 }
 
-static int bce_vhci_urb_control_transfer_completion(struct bce_vhci_urb *urb, struct bce_sq_completion_data *c)
+static int bce_vhci_urb_control_transfer_completion(struct bce_vhci_urb *urb, struct bce_qe_completion *c)
 {
     int status;
     unsigned long timeout;
@@ -565,7 +1045,7 @@ static int bce_vhci_urb_update(struct bce_vhci_urb *urb, struct bce_vhci_message
         return bce_vhci_urb_data_update(urb, msg);
 }
 
-static int bce_vhci_urb_transfer_completion(struct bce_vhci_urb *urb, struct bce_sq_completion_data *c)
+static int bce_vhci_urb_transfer_completion(struct bce_vhci_urb *urb, struct bce_qe_completion *c)
 {
     if (urb->is_control)
         return bce_vhci_urb_control_transfer_completion(urb, c);
@@ -5,11 +5,44 @@
 #include "queue.h"
 #include "command.h"
 #include "../queue.h"
+#include "../queue_dma.h"
 
-struct bce_vhci_list_message {
+/* URBs beyond this many in flight on one endpoint fall back to kzalloc */
+#define BCE_VHCI_URB_POOL_SIZE 32
+/*
+ * Interrupt IN endpoints keep BCE_VHCI_INT_RING_SIZE receive buffers posted to the firmware at all times, so a report
+ * lands without waiting for a URB's transfer request. The counters only grow; buffer n is n % BCE_VHCI_INT_RING_SIZE
+ * and consumed <= completed <= posted <= consumed + BCE_VHCI_INT_RING_SIZE.
+ */
+#define BCE_VHCI_INT_RING_SIZE 4
+struct bce_vhci_int_ring {
+    void *data;
+    dma_addr_t dma_addr;
+    u32 buf_size;
+    u32 posted;
+    u32 completed;
+    u32 consumed;
+    s32 length[BCE_VHCI_INT_RING_SIZE]; /* of each completed report, -1 if it was aborted */
+};
+/*
+ * The endpoints of a USB device share their CQs, one set per interrupt vector, instead of each registering its own;
+ * a CQ holds the completions of up to BCE_VHCI_SHARED_CQ_MAX_SQS full SQs.
+ */
+#define BCE_VHCI_TQ_SQ_EL_COUNT 0x100
+#define BCE_VHCI_SHARED_CQ_MAX_SQS 4
+#define BCE_VHCI_SHARED_CQ_EL_COUNT (BCE_VHCI_TQ_SQ_EL_COUNT * BCE_VHCI_SHARED_CQ_MAX_SQS)
+/*
+ * Firmware events that arrived before the URB they are for, kept in a small ring allocated with the endpoint's
+ * queues. Running out resets the endpoint; the size must stay a power of two as the indexes are free running.
+ */
+#define BCE_VHCI_EVQ_SIZE 32
+struct bce_vhci_shared_cq {
     struct list_head list;
-    struct bce_vhci_message msg;
+    struct bce_queue_cq *cq;
+    enum bce_cq_vector_hint vector;
+    u32 sq_count;
 };
+
 struct bce_vhci_transfer_queue {
     struct bce_vhci *vhci;
     struct usb_host_endpoint *endp;
@@ -19,13 +52,24 @@ struct bce_vhci_transfer_queue {
     bce_vhci_device_t dev_addr;
     u8 endp_addr;
     struct bce_queue_cq *cq;
+    struct bce_vhci_shared_cq *shared_cq;
+    u32 shared_cq_sqs; /* the SQ slots of shared_cq taken by this endpoint */
     struct bce_queue_sq *sq_in;
     struct bce_queue_sq *sq_out;
-    struct list_head evq;
+    struct bce_vhci_message_queue *msg_queue; /* where the transfer requests go, by endpoint type */
+    struct bce_vhci_int_ring *int_ring; /* interrupt IN endpoints only */
+    /* Per SQ slot, the URB the submission in it belongs to; several URBs can be in flight at once */
+    struct bce_vhci_urb **sq_in_urbs;
+    struct bce_vhci_urb **sq_out_urbs;
+    struct bce_vhci_message *evq; /* BCE_VHCI_EVQ_SIZE entries */
+    u32 evq_head, evq_tail; /* free running */
+    struct bce_vhci_urb *urb_pool;
+    DECLARE_BITMAP(urb_pool_used, BCE_VHCI_URB_POOL_SIZE);
     struct spinlock urb_lock;
     struct list_head giveback_urb_list;
 
     struct work_struct w_reset;
+    struct work_struct w_cancel; /* removes every URB marked unlinked that the firmware may own */
 };
 enum bce_vhci_urb_state {
     BCE_VHCI_URB_INIT_PAUSED,
@@ -43,28 +87,28 @@ struct bce_vhci_urb {
     struct bce_vhci_transfer_queue *q;
     enum dma_data_direction dir;
     bool is_control;
+    bool is_iso;
     enum bce_vhci_urb_state state;
     int received_status;
     u32 send_offset;
     u32 receive_offset;
-};
-
-struct bce_vhci_transfer_queue_urb_cancel_work {
-    struct work_struct ws;
-    struct bce_vhci_transfer_queue *q;
-    struct urb *urb;
-    int status;
+    u32 posted; /* submissions still owned by the device */
+    u32 iso_posted; /* isochronous packets handed to the firmware so far */
+    u32 iso_done;
+    bool has_sg;
+    struct bce_dma_buffer sg_buf; /* the segment list for urb->sg, if has_sg */
 };
 
 void bce_vhci_create_transfer_queue(struct bce_vhci *vhci, struct bce_vhci_transfer_queue *q,
         struct usb_host_endpoint *endp, bce_vhci_device_t dev_addr, enum dma_data_direction dir);
 void bce_vhci_destroy_transfer_queue(struct bce_vhci *vhci, struct bce_vhci_transfer_queue *q);
+size_t bce_vhci_transfer_queue_dma_bytes(struct bce_vhci_transfer_queue *q);
 void bce_vhci_transfer_queue_event(struct bce_vhci_transfer_queue *q, struct bce_vhci_message *msg);
 int bce_vhci_transfer_queue_pause(struct bce_vhci_transfer_queue *q);
 int bce_vhci_transfer_queue_resume(struct bce_vhci_transfer_queue *q);
 void bce_vhci_transfer_queue_request_reset(struct bce_vhci_transfer_queue *q);
 
-int bce_vhci_urb_create(struct bce_vhci_transfer_queue *q, struct urb *urb);
+int bce_vhci_urb_create(struct bce_vhci_transfer_queue *q, struct urb *urb, gfp_t mem_flags);
 int bce_vhci_urb_request_cancel(struct bce_vhci_transfer_queue *q, struct urb *urb, int status);
 
 #endif //BCEDRIVER_TRANSFER_H
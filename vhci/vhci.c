@@ -3,6 +3,7 @@
 #include "command.h"
 #include <linux/usb.h>
 #include <linux/usb/hcd.h>
+#include <linux/seq_file.h>
 
 static dev_t bce_vhci_chrdev;
 static struct class *bce_vhci_class;
@@ -20,6 +21,8 @@ int bce_vhci_create(struct apple_bce_device *dev, struct bce_vhci *vhci)
     int status;
 
     spin_lock_init(&vhci->hcd_spinlock);
+    spin_lock_init(&vhci->port_status_lock);
+    mutex_init(&vhci->devices_lock);
 
     vhci->dev = dev;
 
@@ -45,6 +48,12 @@ int bce_vhci_create(struct apple_bce_device *dev, struct bce_vhci *vhci)
     }
     vhci->hcd->self.sysdev = &dev->pci->dev;
     vhci->hcd->self.uses_dma = 1;
+    /*
+     * SG URBs are handed to the firmware as a segment list, without any size constraints on the elements. Capping the
+     * entry count keeps that list in one pooled page, as URBs may be submitted and given back in atomic context.
+     */
+    vhci->hcd->self.sg_tablesize = BCE_ELEMENTS_PER_PAGE;
+    vhci->hcd->self.no_sg_constraint = 1;
     *((struct bce_vhci **) vhci->hcd->hcd_priv) = vhci;
     vhci->hcd->speed = HCD_USB2;
 
@@ -96,11 +105,99 @@ int bce_vhci_start(struct usb_hcd *hcd)
         port_mask >>= 1;
     }
     vhci->port_count = port_no;
+    vhci->port_status_valid = 0;
+    vhci->port_change_mask = 0;
+    /* The root hub is only polled when a port status event reports a change */
+    hcd->uses_new_polling = 1;
     return 0;
 }
 
+#define BCE_VHCI_PORT_STATUS_CONNECTED 4
+#define BCE_VHCI_PORT_STATUS_RESET 8
+#define BCE_VHCI_PORT_STATUS_C_CONNECTION 0x40000
+
+static void bce_vhci_port_status_store(struct bce_vhci *vhci, bce_vhci_port_t port, u32 port_status)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&vhci->port_status_lock, flags);
+    if ((vhci->port_status_valid & BIT(port)) &&
+            ((vhci->port_status[port] ^ port_status) & BCE_VHCI_PORT_STATUS_CONNECTED))
+        vhci->port_change_mask |= BIT(port);
+    if (port_status & BCE_VHCI_PORT_STATUS_C_CONNECTION)
+        vhci->port_change_mask |= BIT(port);
+    vhci->port_status[port] = port_status;
+    vhci->port_status_valid |= BIT(port);
+    spin_unlock_irqrestore(&vhci->port_status_lock, flags);
+}
+
+/* A reset in progress is always read back from the firmware, as its end is not reported by an event */
+static bool bce_vhci_port_status_cached(struct bce_vhci *vhci, bce_vhci_port_t port, u32 *port_status,
+        bool *changed)
+{
+    unsigned long flags;
+    bool ret;
+    spin_lock_irqsave(&vhci->port_status_lock, flags);
+    ret = (vhci->port_status_valid & BIT(port)) && !(vhci->port_status[port] & BCE_VHCI_PORT_STATUS_RESET);
+    *port_status = vhci->port_status[port];
+    *changed = !!(vhci->port_change_mask & BIT(port));
+    spin_unlock_irqrestore(&vhci->port_status_lock, flags);
+    return ret;
+}
+
+/* Called after the port state was changed by a command, the next GetPortStatus refreshes it */
+static void bce_vhci_port_status_invalidate(struct bce_vhci *vhci, bce_vhci_port_t port)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&vhci->port_status_lock, flags);
+    vhci->port_status_valid &= ~BIT(port);
+    spin_unlock_irqrestore(&vhci->port_status_lock, flags);
+}
+
+static void bce_vhci_port_status_event(struct bce_vhci *vhci, struct bce_vhci_message *msg)
+{
+    bce_vhci_port_t port = (bce_vhci_port_t) msg->param1;
+    if (port < 1 || port >= ARRAY_SIZE(vhci->port_status)) {
+        pr_err("bce-vhci: Port status event for an unknown port %i\n", port);
+        return;
+    }
+    bce_vhci_port_status_store(vhci, port, (u32) msg->param2);
+    if (vhci->hcd)
+        usb_hcd_poll_rh_status(vhci->hcd);
+}
+
 static int bce_vhci_hub_status_data(struct usb_hcd *hcd, char *buf)
 {
+    struct bce_vhci *vhci = bce_vhci_from_hcd(hcd);
+    unsigned long flags;
+    int len = 1 + vhci->port_count / 8;
+    u16 changed;
+    int i;
+
+    spin_lock_irqsave(&vhci->port_status_lock, flags);
+    changed = vhci->port_change_mask;
+    spin_unlock_irqrestore(&vhci->port_status_lock, flags);
+    if (!changed)
+        return 0;
+    memset(buf, 0, len);
+    for (i = 1; i <= vhci->port_count && i < 16; i++) {
+        if (changed & BIT(i))
+            buf[i / 8] |= BIT(i % 8);
+    }
+    return len;
+}
+
+static int bce_vhci_port_status_clear_change(struct bce_vhci *vhci, bce_vhci_port_t port)
+{
+    unsigned long flags;
+    int status;
+    u32 port_status;
+    if ((status = bce_vhci_cmd_port_status(&vhci->cq, port, BCE_VHCI_PORT_STATUS_C_CONNECTION, &port_status)))
+        return status;
+    spin_lock_irqsave(&vhci->port_status_lock, flags);
+    vhci->port_status[port] = port_status & ~BCE_VHCI_PORT_STATUS_C_CONNECTION;
+    vhci->port_status_valid |= BIT(port);
+    vhci->port_change_mask &= ~BIT(port);
+    spin_unlock_irqrestore(&vhci->port_status_lock, flags);
     return 0;
 }
 
@@ -112,6 +209,7 @@ static int bce_vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue, u1
     struct usb_hub_status *hs;
     struct usb_port_status *ps;
     u32 port_status;
+    bool changed;
     // pr_info("bce-vhci: bce_vhci_hub_control %x %i %i [bufl=%i]\n", typeReq, wValue, wIndex, wLength);
     if (typeReq == GetHubDescriptor && wLength >= sizeof(struct usb_hub_descriptor)) {
         hd = (struct usb_hub_descriptor *) buf;
@@ -134,8 +232,14 @@ static int bce_vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue, u1
         ps->wPortStatus = 0;
         ps->wPortChange = 0;
 
-        if ((status = bce_vhci_cmd_port_status(&vhci->cq, (u8) wIndex, 0, &port_status)))
-            return status;
+        if (wIndex < 1 || wIndex >= ARRAY_SIZE(vhci->port_status))
+            return -EPIPE;
+        if (!bce_vhci_port_status_cached(vhci, (u8) wIndex, &port_status, &changed)) {
+            if ((status = bce_vhci_cmd_port_status(&vhci->cq, (u8) wIndex, 0, &port_status)))
+                return status;
+            bce_vhci_port_status_store(vhci, (u8) wIndex, port_status);
+            bce_vhci_port_status_cached(vhci, (u8) wIndex, &port_status, &changed);
+        }
 
         if (vhci->port_power_mask & BIT(wIndex))
             ps->wPortStatus |= USB_PORT_STAT_POWER;
@@ -151,10 +255,10 @@ static int bce_vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue, u1
         if (port_status & 0x60)
             ps->wPortStatus |= USB_PORT_STAT_SUSPEND;
 
-        if (port_status & 0x40000)
+        if (changed)
             ps->wPortChange |= USB_PORT_STAT_C_CONNECTION;
 
-        pr_info("bce-vhci: Translated status %x to %x:%x\n", port_status, ps->wPortStatus, ps->wPortChange);
+        pr_debug("bce-vhci: Translated status %x to %x:%x\n", port_status, ps->wPortStatus, ps->wPortChange);
         return 0;
     } else if (typeReq == SetPortFeature) {
         if (wValue == USB_PORT_FEAT_POWER) {
@@ -162,6 +266,7 @@ static int bce_vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue, u1
             /* As far as I am aware, power status is not part of the port status so store it separately */
             if (!status)
                 vhci->port_power_mask |= BIT(wIndex);
+            bce_vhci_port_status_invalidate(vhci, (u8) wIndex);
             return status;
         }
         if (wValue == USB_PORT_FEAT_RESET) {
@@ -169,29 +274,35 @@ static int bce_vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue, u1
             if (vhci->port_reset_mask & BIT(wIndex))
                 return 0;
             vhci->port_reset_mask |= BIT(wIndex);
+            bce_vhci_port_status_invalidate(vhci, (u8) wIndex);
             return bce_vhci_cmd_port_reset(&vhci->cq, (u8) wIndex, wValue);
         }
         if (wValue == USB_PORT_FEAT_SUSPEND) {
             /* TODO: Am I supposed to also suspend the endpoints? */
             pr_info("bce-vhci: Suspending port %i\n", wIndex);
+            bce_vhci_port_status_invalidate(vhci, (u8) wIndex);
             return bce_vhci_cmd_port_suspend(&vhci->cq, (u8) wIndex);
         }
     } else if (typeReq == ClearPortFeature) {
-        if (wValue == USB_PORT_FEAT_ENABLE)
+        if (wValue == USB_PORT_FEAT_ENABLE) {
+            bce_vhci_port_status_invalidate(vhci, (u8) wIndex);
             return bce_vhci_cmd_port_disable(&vhci->cq, (u8) wIndex);
+        }
         if (wValue == USB_PORT_FEAT_POWER) {
             status = bce_vhci_cmd_port_power_off(&vhci->cq, (u8) wIndex);
             if (!status)
                 vhci->port_power_mask &= ~BIT(wIndex);
+            bce_vhci_port_status_invalidate(vhci, (u8) wIndex);
             return status;
         }
         if (wValue == USB_PORT_FEAT_C_CONNECTION)
-            return bce_vhci_cmd_port_status(&vhci->cq, (u8) wIndex, 0x40000, &port_status);
+            return bce_vhci_port_status_clear_change(vhci, (u8) wIndex);
         if (wValue == USB_PORT_FEAT_C_RESET) { /* I don't think I can transfer it in any way */
             return 0;
         }
         if (wValue == USB_PORT_FEAT_SUSPEND) {
             pr_info("bce-vhci: Resuming port %i\n", wIndex);
+            bce_vhci_port_status_invalidate(vhci, (u8) wIndex);
             return bce_vhci_cmd_port_resume(&vhci->cq, (u8) wIndex);
         }
     }
@@ -200,34 +311,158 @@ static int bce_vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue, u1
     return -EIO;
 }
 
+/* The device enable_device created for udev, if the port still maps to it */
+static struct bce_vhci_device *bce_vhci_udev_to_device(struct bce_vhci *vhci, struct usb_device *udev,
+        bce_vhci_device_t *devid)
+{
+    struct bce_vhci_device *vdev;
+    *devid = vhci->port_to_device[udev->portnum];
+    vdev = *devid ? vhci->devices[*devid] : NULL;
+    if (!vdev || vdev->udev != udev)
+        return NULL;
+    return vdev;
+}
+
+static void bce_vhci_device_release(struct kref *ref)
+{
+    struct bce_vhci_device *vdev = container_of(ref, struct bce_vhci_device, ref);
+    mutex_destroy(&vdev->lock);
+    kfree(vdev);
+}
+
+/* Like bce_vhci_udev_to_device, but takes devices_lock and returns the device pinned; bce_vhci_put_device unpins it */
+static struct bce_vhci_device *bce_vhci_udev_get_device(struct bce_vhci *vhci, struct usb_device *udev,
+        bce_vhci_device_t *devid)
+{
+    struct bce_vhci_device *vdev;
+    mutex_lock(&vhci->devices_lock);
+    vdev = bce_vhci_udev_to_device(vhci, udev, devid);
+    if (vdev)
+        kref_get(&vdev->ref);
+    mutex_unlock(&vhci->devices_lock);
+    return vdev;
+}
+
+static void bce_vhci_put_device(struct bce_vhci_device *vdev)
+{
+    kref_put(&vdev->ref, bce_vhci_device_release);
+}
+
+static struct bce_vhci_device *bce_vhci_unpublish_device(struct bce_vhci *vhci, bce_vhci_device_t devid);
+static void bce_vhci_destroy_device(struct bce_vhci *vhci, struct bce_vhci_device *vdev, bce_vhci_device_t devid);
+
 static int bce_vhci_enable_device(struct usb_hcd *hcd, struct usb_device *udev)
 {
     struct bce_vhci *vhci = bce_vhci_from_hcd(hcd);
-    struct bce_vhci_device *vdev;
+    struct bce_vhci_device *vdev, *stale = NULL;
     bce_vhci_device_t devid;
     pr_info("bce_vhci_enable_device\n");
 
-    if (vhci->port_to_device[udev->portnum])
+    mutex_lock(&vhci->devices_lock);
+    if (bce_vhci_udev_to_device(vhci, udev, &devid)) {
+        mutex_unlock(&vhci->devices_lock);
         return 0;
+    }
+    /* The udev that was on this port before hasn't been freed yet, its device is of no use to the new one */
+    if (devid && vhci->devices[devid]) {
+        pr_info("bce-vhci: Replacing stale device %i on port %i\n", devid, udev->portnum);
+        stale = bce_vhci_unpublish_device(vhci, devid);
+    }
+    mutex_unlock(&vhci->devices_lock);
+    if (stale)
+        bce_vhci_destroy_device(vhci, stale, devid);
+
+    vdev = kzalloc(sizeof(struct bce_vhci_device), GFP_KERNEL);
+    if (!vdev)
+        return -ENOMEM;
+    mutex_init(&vdev->lock);
+    INIT_LIST_HEAD(&vdev->cqs);
+    kref_init(&vdev->ref);
+    vdev->portnum = (u8) udev->portnum;
+    vdev->udev = udev;
 
     /* We need to early address the device */
-    if (bce_vhci_cmd_device_create(&vhci->cq, udev->portnum, &devid))
+    if (bce_vhci_cmd_device_create(&vhci->cq, udev->portnum, &devid)) {
+        mutex_destroy(&vdev->lock);
+        kfree(vdev);
         return -EIO;
+    }
 
     pr_info("bce_vhci_cmd_device_create %i -> %i\n", udev->portnum, devid);
 
-    vdev = kzalloc(sizeof(struct bce_vhci_device), GFP_KERNEL);
+    mutex_lock(&vhci->devices_lock);
     vhci->port_to_device[udev->portnum] = devid;
     vhci->devices[devid] = vdev;
+    mutex_unlock(&vhci->devices_lock);
 
+    mutex_lock(&vdev->lock);
     bce_vhci_create_transfer_queue(vhci, &vdev->tq[0], &udev->ep0, devid, DMA_BIDIRECTIONAL);
     udev->ep0.hcpriv = &vdev->tq[0];
     vdev->tq_mask |= BIT(0);
+    mutex_unlock(&vdev->lock);
 
     bce_vhci_cmd_endpoint_create(&vhci->cq, devid, &udev->ep0.desc);
     return 0;
 }
 
+static void bce_vhci_destroy_endpoint(struct bce_vhci *vhci, struct bce_vhci_device *vdev, bce_vhci_device_t devid,
+        u8 endp_index);
+
+/* Makes the device unreachable for the firmware events, before bce_vhci_destroy_device. Called with devices_lock held */
+static struct bce_vhci_device *bce_vhci_unpublish_device(struct bce_vhci *vhci, bce_vhci_device_t devid)
+{
+    struct bce_vhci_device *vdev = vhci->devices[devid];
+    vhci->port_to_device[vdev->portnum] = 0;
+    vhci->devices[devid] = NULL;
+    return vdev;
+}
+
+/*
+ * Tears down what enable_device and add_endpoint created, the firmware device and every endpoint left. The device must
+ * have been unpublished; called without devices_lock, as it waits once for the events and state works that may have
+ * looked it up already.
+ */
+static void bce_vhci_destroy_device(struct bce_vhci *vhci, struct bce_vhci_device *vdev, bce_vhci_device_t devid)
+{
+    u32 tq_mask;
+    int i;
+
+    bce_sync_queues(vhci->dev);
+    flush_workqueue(vhci->tq_state_wq);
+
+    mutex_lock(&vdev->lock);
+    vdev->dead = true;
+    tq_mask = vdev->tq_mask;
+    vdev->tq_mask = 0;
+    for (i = 0; i < ARRAY_SIZE(vdev->tq); i++) {
+        if (tq_mask & BIT(i))
+            bce_vhci_destroy_endpoint(vhci, vdev, devid, (u8) i);
+    }
+    mutex_unlock(&vdev->lock);
+    if (!vhci->dev->is_being_removed)
+        bce_vhci_cmd_device_destroy(&vhci->cq, devid);
+    bce_vhci_put_device(vdev);
+}
+
+static void bce_vhci_free_device(struct usb_hcd *hcd, struct usb_device *udev)
+{
+    struct bce_vhci *vhci = bce_vhci_from_hcd(hcd);
+    struct bce_vhci_device *vdev = NULL;
+    bce_vhci_device_t devid;
+
+    if (udev->bus->root_hub == udev)
+        return;
+    mutex_lock(&vhci->devices_lock);
+    /* Nothing to do if enable_device already replaced the device with one for a newer udev */
+    if (bce_vhci_udev_to_device(vhci, udev, &devid)) {
+        pr_info("bce_vhci_free_device %i -> %i\n", udev->portnum, devid);
+        vdev = bce_vhci_unpublish_device(vhci, devid);
+    }
+    mutex_unlock(&vhci->devices_lock);
+    if (vdev)
+        bce_vhci_destroy_device(vhci, vdev, devid);
+}
+
 static int bce_vhci_address_device(struct usb_hcd *hcd, struct usb_device *udev)
 {
     return 0;
@@ -243,13 +478,25 @@ static int bce_vhci_get_frame_number(struct usb_hcd *hcd)
     return 0;
 }
 
+/*
+ * The interrupt IN ring copies each report into the URB with the CPU, so those URBs are left unmapped. Nothing sets
+ * the URB_DMA_MAP_* flags for them, which leaves the default unmap with nothing to undo.
+ */
+static int bce_vhci_map_urb_for_dma(struct usb_hcd *hcd, struct urb *urb, gfp_t mem_flags)
+{
+    struct bce_vhci_transfer_queue *q = urb->ep->hcpriv;
+    if (q && q->int_ring)
+        return 0;
+    return usb_hcd_map_urb_for_dma(hcd, urb, mem_flags);
+}
+
 static int bce_vhci_urb_enqueue(struct usb_hcd *hcd, struct urb *urb, gfp_t mem_flags)
 {
     struct bce_vhci_transfer_queue *q = urb->ep->hcpriv;
     pr_debug("bce_vhci_urb_enqueue %x\n", urb->ep->desc.bEndpointAddress);
     if (!q)
         return -ENOENT;
-    return bce_vhci_urb_create(q, urb);
+    return bce_vhci_urb_create(q, urb, mem_flags);
 }
 
 static int bce_vhci_urb_dequeue(struct usb_hcd *hcd, struct urb *urb, int status)
@@ -278,23 +525,34 @@ static int bce_vhci_add_endpoint(struct usb_hcd *hcd, struct usb_device *udev, s
 {
     u8 endp_index = bce_vhci_endpoint_index(endp->desc.bEndpointAddress);
     struct bce_vhci *vhci = bce_vhci_from_hcd(hcd);
-    bce_vhci_device_t devid = vhci->port_to_device[udev->portnum];
-    struct bce_vhci_device *vdev = vhci->devices[devid];
-    pr_info("bce_vhci_add_endpoint %x/%x:%x\n", udev->portnum, devid, endp_index);
+    bce_vhci_device_t devid;
+    struct bce_vhci_device *vdev;
 
     if (udev->bus->root_hub == udev) /* The USB hub */
         return 0;
+    vdev = bce_vhci_udev_get_device(vhci, udev, &devid);
+    pr_info("bce_vhci_add_endpoint %x/%x:%x\n", udev->portnum, devid, endp_index);
     if (vdev == NULL)
         return -ENODEV;
+
+    mutex_lock(&vdev->lock);
+    if (vdev->dead) {
+        mutex_unlock(&vdev->lock);
+        bce_vhci_put_device(vdev);
+        return -ENODEV;
+    }
     if (vdev->tq_mask & BIT(endp_index)) {
         endp->hcpriv = &vdev->tq[endp_index];
+        mutex_unlock(&vdev->lock);
+        bce_vhci_put_device(vdev);
         return 0;
     }
-
     bce_vhci_create_transfer_queue(vhci, &vdev->tq[endp_index], endp, devid,
             usb_endpoint_dir_in(&endp->desc) ? DMA_FROM_DEVICE : DMA_TO_DEVICE);
     endp->hcpriv = &vdev->tq[endp_index];
     vdev->tq_mask |= BIT(endp_index);
+    mutex_unlock(&vdev->lock);
+    bce_vhci_put_device(vdev);
 
     bce_vhci_cmd_endpoint_create(&vhci->cq, devid, &endp->desc);
     return 0;
@@ -304,26 +562,98 @@ static int bce_vhci_drop_endpoint(struct usb_hcd *hcd, struct usb_device *udev,
 {
     u8 endp_index = bce_vhci_endpoint_index(endp->desc.bEndpointAddress);
     struct bce_vhci *vhci = bce_vhci_from_hcd(hcd);
-    bce_vhci_device_t devid = vhci->port_to_device[udev->portnum];
-    struct bce_vhci_transfer_queue *q = endp->hcpriv;
-    struct bce_vhci_device *vdev = vhci->devices[devid];
+    bce_vhci_device_t devid;
+    struct bce_vhci_device *vdev = bce_vhci_udev_get_device(vhci, udev, &devid);
+    bool drop;
     pr_info("bce_vhci_drop_endpoint %x:%x\n", udev->portnum, endp_index);
-    if (!q) {
-        if (vdev && vdev->tq_mask & BIT(endp_index)) {
-            pr_err("something deleted the hcpriv?\n");
-            q = &vdev->tq[endp_index];
-        } else {
-            return 0;
-        }
+    if (!vdev)
+        return 0;
+    mutex_lock(&vdev->lock);
+    drop = vdev->tq_mask & BIT(endp_index);
+    if (!endp->hcpriv && drop)
+        pr_err("something deleted the hcpriv?\n");
+    /* Stop routing firmware events to the queue; with the bit clear, a device teardown meanwhile leaves it to us */
+    vdev->tq_mask &= ~BIT(endp_index);
+    mutex_unlock(&vdev->lock);
+    if (drop) {
+        bce_sync_queues(vhci->dev);
+        flush_workqueue(vhci->tq_state_wq);
+        mutex_lock(&vdev->lock);
+        bce_vhci_destroy_endpoint(vhci, vdev, devid, endp_index);
+        mutex_unlock(&vdev->lock);
     }
-    /*
-    bce_vhci_cmd_endpoint_destroy(&vhci->cq, devid, (u8) (endp->desc.bEndpointAddress & 0x8F));
-    vhci->devices[devid]->tq_mask &= ~BIT(endp_index);
-    bce_vhci_destroy_transfer_queue(vhci, q);
-    */
+    bce_vhci_put_device(vdev);
     return 0;
 }
 
+/*
+ * The USB core has already flushed the URBs of the endpoint, and the caller has cleared its tq_mask bit and waited for
+ * the events already being handled. Called with the device lock held.
+ */
+static void bce_vhci_destroy_endpoint(struct bce_vhci *vhci, struct bce_vhci_device *vdev, bce_vhci_device_t devid,
+        u8 endp_index)
+{
+    struct bce_vhci_transfer_queue *q = &vdev->tq[endp_index];
+    unsigned long flags;
+
+    spin_lock_irqsave(&q->urb_lock, flags);
+    q->active = false;
+    spin_unlock_irqrestore(&q->urb_lock, flags);
+    if (!vhci->dev->is_being_removed)
+        bce_vhci_cmd_endpoint_destroy(&vhci->cq, devid, q->endp_addr);
+    if (q->endp)
+        q->endp->hcpriv = NULL;
+    bce_vhci_destroy_transfer_queue(vhci, q);
+}
+
+static void bce_vhci_report_device(struct bce_vhci_device *vdev, bce_vhci_device_t devid, struct seq_file *s)
+{
+    struct bce_vhci_shared_cq *scq;
+    struct bce_vhci_transfer_queue *q;
+    size_t dma_bytes = 0;
+    u32 qids = 0;
+    int i;
+
+    list_for_each_entry(scq, &vdev->cqs, list) {
+        dma_bytes += scq->cq->el_count * sizeof(struct bce_qe_completion);
+        ++qids;
+    }
+    for (i = 0; i < ARRAY_SIZE(vdev->tq); i++) {
+        if (!(vdev->tq_mask & BIT(i)))
+            continue;
+        q = &vdev->tq[i];
+        dma_bytes += bce_vhci_transfer_queue_dma_bytes(q);
+        qids += !!q->sq_in + !!q->sq_out;
+    }
+    seq_printf(s, "device %i port %i: qids %u dma_bytes %zu\n", devid, vdev->portnum, qids, dma_bytes);
+    list_for_each_entry(scq, &vdev->cqs, list)
+        seq_printf(s, "  cq %i vector %i sqs %u\n", scq->cq->qid, scq->cq->vector, scq->sq_count);
+    for (i = 0; i < ARRAY_SIZE(vdev->tq); i++) {
+        if (!(vdev->tq_mask & BIT(i)))
+            continue;
+        q = &vdev->tq[i];
+        seq_printf(s, "  ep %02x cq %i sq_in %i sq_out %i dma_bytes %zu\n", q->endp_addr, q->cq ? q->cq->qid : -1,
+                q->sq_in ? q->sq_in->qid : -1, q->sq_out ? q->sq_out->qid : -1, bce_vhci_transfer_queue_dma_bytes(q));
+    }
+}
+
+/* Which qids and how much ring memory each USB device holds */
+void bce_vhci_report_queues(struct bce_vhci *vhci, struct seq_file *s)
+{
+    struct bce_vhci_device *vdev;
+    int i;
+    mutex_lock(&vhci->devices_lock);
+    for (i = 0; i < ARRAY_SIZE(vhci->devices); i++) {
+        vdev = vhci->devices[i];
+        if (!vdev)
+            continue;
+        mutex_lock(&vdev->lock);
+        bce_vhci_report_device(vdev, (bce_vhci_device_t) i, s);
+        mutex_unlock(&vdev->lock);
+    }
+    mutex_unlock(&vhci->devices_lock);
+}
+
 static int bce_vhci_create_message_queues(struct bce_vhci *vhci)
 {
     if (bce_vhci_message_queue_create(vhci, &vhci->msg_commands, "VHC1HostCommands") ||
@@ -334,7 +664,6 @@ static int bce_vhci_create_message_queues(struct bce_vhci *vhci)
         bce_vhci_destroy_message_queues(vhci);
         return -EINVAL;
     }
-    spin_lock_init(&vhci->msg_asynchronous_lock);
     bce_vhci_command_queue_create(&vhci->cq, &vhci->msg_commands);
     return 0;
 }
@@ -354,7 +683,7 @@ static void bce_vhci_handle_usb_event(struct bce_vhci_event_queue *q, struct bce
 
 static int bce_vhci_create_event_queues(struct bce_vhci *vhci)
 {
-    vhci->ev_cq = bce_create_cq(vhci->dev, 0x100);
+    vhci->ev_cq = bce_create_cq(vhci->dev, 0x100, BCE_CQ_VECTOR_INTERRUPT);
     if (!vhci->ev_cq)
         return -EINVAL;
 #define CREATE_EVENT_QUEUE(field, name, cb) bce_vhci_event_queue_create(vhci, &vhci->field, name, cb)
@@ -461,7 +790,7 @@ static void bce_vhci_handle_firmware_events_w(struct work_struct *ws)
 
         pr_debug("bce-vhci: Got fw event: %x s=%x p1=%x p2=%llx\n", msg->cmd, msg->status, msg->param1, msg->param2);
         if (bce_next_completion(sq)) {
-            msg2 = &vhci->ev_commands.data[(sq->head + 1) % sq->el_count];
+            msg2 = &vhci->ev_commands.data[(sq->head + 1) & sq->el_mask];
             pr_debug("bce-vhci: Got second fw event: %x s=%x p1=%x p2=%llx\n",
                     msg->cmd, msg->status, msg->param1, msg->param2);
             if (msg2->cmd == (msg->cmd | 0x4000) && msg2->param1 == msg->param1) {
@@ -498,6 +827,8 @@ static void bce_vhci_handle_system_event(struct bce_vhci_event_queue *q, struct
 {
     if (msg->cmd & 0x8000) {
         bce_vhci_command_queue_deliver_completion(&q->vhci->cq, msg);
+    } else if (msg->cmd == BCE_VHCI_CMD_PORT_STATUS) {
+        bce_vhci_port_status_event(q->vhci, msg);
     } else {
         pr_warn("bce-vhci: Unhandled system event: %x s=%x p1=%x p2=%llx\n",
                 msg->cmd, msg->status, msg->param1, msg->param2);
@@ -538,12 +869,14 @@ static const struct hc_driver bce_vhci_driver = {
         .start = bce_vhci_start,
         .hub_status_data = bce_vhci_hub_status_data,
         .hub_control = bce_vhci_hub_control,
+        .map_urb_for_dma = bce_vhci_map_urb_for_dma,
         .urb_enqueue = bce_vhci_urb_enqueue,
         .urb_dequeue = bce_vhci_urb_dequeue,
         .enable_device = bce_vhci_enable_device,
         .address_device = bce_vhci_address_device,
         .add_endpoint = bce_vhci_add_endpoint,
         .drop_endpoint = bce_vhci_drop_endpoint,
+        .free_dev = bce_vhci_free_device,
         .endpoint_reset = bce_vhci_endpoint_reset,
         .check_bandwidth = bce_vhci_check_bandwidth,
         .get_frame_number = bce_vhci_get_frame_number
@@ -3,13 +3,27 @@
 
 #include "queue.h"
 #include "transfer.h"
+#include <linux/kref.h>
 
 struct usb_hcd;
 struct bce_queue_cq;
+struct seq_file;
 
 struct bce_vhci_device {
     struct bce_vhci_transfer_queue tq[32];
     u32 tq_mask;
+    u8 portnum;
+    struct usb_device *udev; /* the one enable_device created this for, lookups by port check it */
+    struct mutex lock; /* endpoint creation and teardown */
+    struct list_head cqs; /* struct bce_vhci_shared_cq */
+    struct kref ref; /* add_endpoint and drop_endpoint pin it, teardown may run meanwhile */
+    bool dead; /* torn down, no endpoints may be added anymore */
+};
+struct bce_vhci_iso_stats {
+    atomic64_t urbs;
+    atomic64_t packets;
+    atomic64_t missed; /* packets that failed or were aborted, i.e. an interval without data */
+    atomic64_t bytes;
 };
 struct bce_vhci {
     struct apple_bce_device *dev;
@@ -22,7 +36,6 @@ struct bce_vhci {
     struct bce_vhci_message_queue msg_isochronous;
     struct bce_vhci_message_queue msg_interrupt;
     struct bce_vhci_message_queue msg_asynchronous;
-    struct spinlock msg_asynchronous_lock;
     struct bce_vhci_command_queue cq;
     struct bce_queue_cq *ev_cq;
     struct bce_vhci_event_queue ev_commands;
@@ -34,10 +47,17 @@ struct bce_vhci {
     u8 port_count;
     u16 port_power_mask;
     u16 port_reset_mask;
+    /* Raw firmware port status, kept current by the port status events; port_status_valid marks the filled entries */
+    struct spinlock port_status_lock;
+    u32 port_status[16];
+    u16 port_status_valid;
+    u16 port_change_mask;
     bce_vhci_device_t port_to_device[16];
     struct bce_vhci_device *devices[16];
+    struct mutex devices_lock;
     struct workqueue_struct *tq_state_wq;
     struct work_struct w_fw_events;
+    struct bce_vhci_iso_stats iso_stats;
 };
 
 int __init bce_vhci_module_init(void);
@@ -45,5 +65,6 @@ void __exit bce_vhci_module_exit(void);
 
 int bce_vhci_create(struct apple_bce_device *dev, struct bce_vhci *vhci);
 void bce_vhci_destroy(struct bce_vhci *vhci);
+void bce_vhci_report_queues(struct bce_vhci *vhci, struct seq_file *s);
 
 #endif //BCE_VHCI_H